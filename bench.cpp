@@ -0,0 +1,355 @@
+// Benchmarks for the hot path of the poller: CRC, frame extraction, reply parsing, snapshot
+// publication and serialization, each against the same corpus of real reply frames, plus an
+// end-to-end run against the simulator.
+// Build target: inverter_bench (not installed, run by hand)
+//
+//   inverter_bench                 stage benchmarks only
+//   inverter_bench -e              also end-to-end, starting inverter_sim from the build dir
+//   inverter_bench -e <device>     also end-to-end, against an already running simulator
+// ------------------------------------------------------------------------
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "crc.h"
+#include "decoder.h"
+#include "inputparser.h"
+#include "inverter.h"
+#include "output.h"
+#include "parser.h"
+
+using namespace std::chrono;
+
+bool runOnce = false;
+
+// Every heap allocation is counted, so a stage that starts allocating shows up in the report
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Out of line: GCC would otherwise see free() on memory from operator new at inlined call
+// sites and warn (-Wmismatched-new-delete)
+static __attribute__((noinline)) void release(void *p) {
+    free(p);
+}
+
+void operator delete(void *p) noexcept {
+    release(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    release(p);
+}
+
+void operator delete[](void *p) noexcept {
+    release(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    release(p);
+}
+
+// Sample reply frames (payload only, as the CRC sees them)
+static const char *corpus[] = {
+    "(B",
+    "(230.0 50.0 230.0 50.0 0161 0119 003 460 57.50 012 100 0069 0014 103.8 57.45 00000 00110110 00 00 00856 010",
+    "(230.0 21.7 230.0 50.0 21.7 5000 4000 48.0 46.0 42.0 56.4 54.0 0 10 010 1 0 0 6 01 0 0 54.0 0 1",
+    "(00000000000000000000000000000000",
+};
+
+// The original nibble-at-a-time implementation, kept as the reference
+static uint16_t cal_crc_half(const uint8_t *pin, size_t len) {
+    static const uint16_t crc_ta[16]= {
+        0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
+        0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef
+    };
+    uint16_t crc = 0;
+    uint8_t da;
+
+    while (len-- != 0) {
+        da = ((uint8_t)(crc>>8))>>4;
+        crc <<= 4;
+        crc ^= crc_ta[da^(*pin>>4)];
+        da = ((uint8_t)(crc>>8))>>4;
+        crc <<= 4;
+        crc ^= crc_ta[da^(*pin&0x0f)];
+        pin++;
+    }
+    return crc;
+}
+
+typedef uint16_t (*crc_fn)(const uint8_t *, size_t);
+
+// Results go here so the compiler cannot drop the benchmarked calls
+static volatile uint16_t sink;
+static volatile int isink;
+
+// Runs fn over every buffer until ~200ms have passed, returns ns per call
+static double bench(crc_fn fn, const std::vector<std::vector<uint8_t> > &bufs) {
+    long calls = 0;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point now;
+
+    do {
+        for (int rep = 0; rep < 1000; rep++)
+            for (size_t i = 0; i < bufs.size(); i++)
+                sink = fn(bufs[i].data(), bufs[i].size());
+        calls += 1000 * bufs.size();
+        now = steady_clock::now();
+    } while (now - start < milliseconds(200));
+
+    return (double)duration_cast<nanoseconds>(now - start).count() / calls;
+}
+
+static void crc_suite(const char *title, const std::vector<std::vector<uint8_t> > &bufs) {
+    struct { const char *name; crc_fn fn; } impl[] = {
+        { "nibble (cal_crc_half)", cal_crc_half },
+        { "table 256",             crc16_table },
+        { "slicing-by-4",          crc16_slice4 },
+        { "slicing-by-8",          crc16_slice8 },
+    };
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < bufs.size(); i++)
+        bytes += bufs[i].size();
+
+    printf("%s (%zu buffers, %zu bytes)\n", title, bufs.size(), bytes);
+    double base = 0;
+    for (size_t k = 0; k < sizeof(impl) / sizeof(impl[0]); k++) {
+        double ns = bench(impl[k].fn, bufs);
+        if (!k)
+            base = ns;
+        printf("  %-24s %9.1f ns/op  %7.2f ns/byte  x%.1f\n", impl[k].name, ns,
+               ns * bufs.size() / bytes, base / ns);
+    }
+}
+
+static int crc_verify() {
+    uint8_t buf[4096];
+    int errors = 0;
+
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 131 + 7);
+
+    // Every length (so all remainder paths are hit), every implementation
+    for (size_t len = 0; len <= 300; len++) {
+        uint16_t ref = cal_crc_half(buf, len);
+        if (crc16_table(buf, len) != ref || crc16_slice4(buf, len) != ref || crc16_slice8(buf, len) != ref) {
+            printf("CRC mismatch at length %zu\n", len);
+            errors++;
+        }
+    }
+    // Known answer: CRC-16/XMODEM("123456789") = 0x31C3
+    if (crc16_slice8((const uint8_t*)"123456789", 9) != 0x31c3) {
+        printf("CRC check value mismatch\n");
+        errors++;
+    }
+    return errors;
+}
+
+// Runs fn until ~200ms have passed, prints ns and allocations per call
+template <class F>
+static void stage(const char *name, F fn) {
+    long calls = 0;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point now;
+    unsigned long allocs = allocations;
+
+    do {
+        for (int rep = 0; rep < 1000; rep++)
+            fn();
+        calls += 1000;
+        now = steady_clock::now();
+    } while (now - start < milliseconds(200));
+
+    printf("  %-34s %9.1f ns/op  %6.2f allocs/op\n", name,
+           (double)duration_cast<nanoseconds>(now - start).count() / calls,
+           (double)(allocations - allocs) / calls);
+}
+
+// Wire format of a reply: payload, CRC, CR
+static std::string wire_frame(const char *payload) {
+    std::string f = payload;
+    uint16_t crc = cal_crc((const uint8_t*)payload, f.size());
+    f += (char)(crc >> 8);
+    f += (char)(crc & 0xff);
+    f += '\r';
+    return f;
+}
+
+// The reply handling of cInverter::receive(): bytes arrive in 'chunk' sized reads and go
+// through the frame decoder, which finds the start byte and CR and checks the CRC
+static int extract_frame(cFrameDecoder &dec, const std::string &wire, int chunk) {
+    const unsigned char *frame;
+    int len;
+
+    dec.Reset();
+    for (int i = 0; i < (int)wire.size(); i += chunk) {
+        dec.Feed((const unsigned char*)wire.data() + i, std::min(chunk, (int)wire.size() - i));
+        int event;
+        while ((event = dec.Next(&frame, &len)) != cFrameDecoder::MORE)
+            if (event == cFrameDecoder::FRAME)
+                return len;
+    }
+    return -1;
+}
+
+static void pipeline_suite() {
+    static cFrameDecoder dec;
+    std::vector<std::string> wire;
+
+    for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+        wire.push_back(wire_frame(corpus[i]));
+    const std::string &qpigs_wire = wire[1];
+    const char *qpigs = corpus[1] + 1;      // replies are parsed without the '('
+    const char *qpiri = corpus[2] + 1;
+    const char *qpiws = corpus[3] + 1;
+
+    printf("Pipeline stages (QPIGS frame, %zu bytes on the wire)\n", qpigs_wire.size());
+
+    stage("CRC check (CheckCRC)", [&] {
+        isink = cInverter::CheckCRC((const unsigned char*)qpigs_wire.data(), qpigs_wire.size());
+    });
+    stage("frame decoding, 8 byte reads", [&] { isink = extract_frame(dec, qpigs_wire, 8); });
+    stage("frame decoding, 64 byte reads", [&] { isink = extract_frame(dec, qpigs_wire, 64); });
+
+    QpigsReply pigs;
+    QpiriReply piri;
+    QpiwsReply piws;
+    stage("parse QPIGS", [&] { isink = ParseQpigs(qpigs, &pigs); });
+    stage("parse QPIRI", [&] { isink = ParseQpiri(qpiri, &piri); });
+    stage("parse QPIWS", [&] { isink = ParseQpiws(qpiws, &piws); });
+
+    static cSeqlock<InverterSnapshot> shared;
+    static InverterSnapshot work, snap;
+    snprintf(work.qpigs, sizeof(work.qpigs), "%s", qpigs);
+    snprintf(work.qpiri, sizeof(work.qpiri), "%s", qpiri);
+    stage("snapshot publish (seqlock store)", [&] { work.version++; shared.Store(work); });
+    stage("snapshot read (seqlock load)", [&] { shared.Load(&snap); isink = snap.version; });
+
+    Sample s;
+    memset(&s, 0, sizeof(s));
+    s.qpigs = pigs;
+    s.qpiri = piri;
+    s.qpiws = piws;
+    const char *formats[] = { "json", "ndjson", "csv", "binary" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        cOutput *out = cOutput::Create(formats[i]);
+        std::string name = std::string("serialize ") + formats[i];
+        char text[4096];
+        out->Format(s, text, sizeof(text));        // csv: header line out of the way
+        stage(name.c_str(), [&] { isink = out->Format(s, text, sizeof(text)); });
+        delete out;
+    }
+}
+
+// Starts inverter_sim from the directory of this binary, returns its pid
+static pid_t start_simulator(const char *argv0, const std::string &link) {
+    std::string dir = argv0;
+    size_t slash = dir.rfind('/');
+    std::string sim = (slash == std::string::npos ? "." : dir.substr(0, slash)) + "/inverter_sim";
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(sim.c_str(), sim.c_str(), "-l", link.c_str(), (char*)NULL);
+        perror(sim.c_str());
+        _exit(1);
+    }
+    for (int i = 0; i < 100 && access(link.c_str(), F_OK) != 0; i++)
+        usleep(10000);
+    return pid;
+}
+
+// Query, parse and serialize QPIGS samples back to back for a few seconds
+static int end_to_end(const std::string &device) {
+    cNotifier notifier;
+    cInverter ups(device, 0, notifier);
+    cOutput *out = cOutput::Create("ndjson");
+    std::string reply;
+    Sample s;
+    char text[4096];
+    long samples = 0, errors = 0;
+
+    memset(&s, 0, sizeof(s));
+    if (!ups.ExecuteCmd("QPIRI", reply) || !ParseQpiri(reply.c_str(), &s.qpiri)) {
+        printf("End-to-end: no valid reply from %s\n", device.c_str());
+        delete out;
+        return 1;
+    }
+
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point now;
+    unsigned long allocs = allocations;
+    do {
+        if (ups.ExecuteCmd("QPIGS", reply) && ParseQpigs(reply.c_str(), &s.qpigs) &&
+            out->Format(s, text, sizeof(text)) > 0)
+            samples++;
+        else
+            errors++;
+        now = steady_clock::now();
+    } while (now - start < seconds(3));
+
+    double secs = duration_cast<microseconds>(now - start).count() / 1e6;
+    printf("End-to-end against %s (query + parse + ndjson)\n", device.c_str());
+    printf("  %ld samples, %ld errors: %.0f samples/s, %.1f us/sample, %.2f allocs/sample\n",
+           samples, errors, samples / secs, secs * 1e6 / (samples ? samples : 1),
+           (double)(allocations - allocs) / (samples + errors ? samples + errors : 1));
+    delete out;
+    return errors ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    InputParser args(argc, argv);
+
+    if (crc_verify())
+        return 1;
+
+    std::vector<std::vector<uint8_t> > frames;
+    for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++)
+        frames.push_back(std::vector<uint8_t>(corpus[i], corpus[i] + strlen(corpus[i])));
+    crc_suite("CRC, reply frames", frames);
+
+    std::vector<std::vector<uint8_t> > bulk(1, std::vector<uint8_t>(64 * 1024));
+    for (size_t i = 0; i < bulk[0].size(); i++)
+        bulk[0][i] = (uint8_t)(i * 131 + 7);
+    crc_suite("CRC, 64k bulk buffer", bulk);
+
+    pipeline_suite();
+
+    if (!args.cmdOptionExists("-e"))
+        return 0;
+
+    std::string device = args.getCmdOption("-e");
+    pid_t sim = 0;
+    fflush(stdout);
+    if (device.empty() || device[0] == '-') {
+        device = "/tmp/inverter_bench." + std::to_string(getpid());
+        sim = start_simulator(argv[0], device);
+    }
+    int rc = end_to_end(device);
+    if (sim > 0) {
+        kill(sim, SIGTERM);
+        waitpid(sim, NULL, 0);
+    }
+    return rc;
+}
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "capture.h"
+#include "tools.h"
+
+#define CAPTURE_MAGIC   0x43564e49      // "INVC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER  16              // file header
+#define RECORD_HEADER   12              // record header
+
+static int64_t clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool cCapture::Open(const std::string &path) {
+    struct stat st;
+
+    Close();
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        lerror("CAPTURE: Unable to open %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        Close();
+        return false;
+    }
+
+    if (st.st_size == 0) {
+        unsigned char h[CAPTURE_HEADER];
+        uint32_t magic = CAPTURE_MAGIC, version = CAPTURE_VERSION;
+        memset(h, 0, sizeof(h));
+        memcpy(h, &magic, 4);
+        memcpy(h + 4, &version, 4);
+        if (write(fd, h, sizeof(h)) != sizeof(h)) {
+            lerror("CAPTURE: Unable to create %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+            Close();
+            return false;
+        }
+    } else {
+        uint32_t h[2];
+        int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        bool ok = rfd != -1 && read(rfd, h, sizeof(h)) == sizeof(h) && h[0] == CAPTURE_MAGIC && h[1] == CAPTURE_VERSION;
+        if (rfd != -1)
+            close(rfd);
+        if (!ok) {
+            lerror("CAPTURE: %s is not a capture file of this version, not touching it", path.c_str());
+            Close();
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    int64_t now = clock_us(CLOCK_REALTIME);
+    if (!append(0, CAP_OPEN, &now, sizeof(now)))
+        return false;
+    linfo("CAPTURE: Recording to %s", path.c_str());
+    return true;
+}
+
+void cCapture::Close() {
+    std::lock_guard<std::mutex> lock(m);
+    if (fd != -1)
+        close(fd);
+    fd = -1;
+}
+
+// With m held
+bool cCapture::append(int unit, int type, const void *data, int len) {
+    unsigned char h[RECORD_HEADER];
+    int64_t t = clock_us(CLOCK_MONOTONIC);
+    uint16_t n = len;
+
+    memcpy(h, &t, 8);
+    memcpy(h + 8, &n, 2);
+    h[10] = unit;
+    h[11] = type;
+
+    // One write() per record: with O_APPEND records never interleave, not even between processes
+    struct iovec iov[2] = { { h, sizeof(h) }, { (void*)data, (size_t)n } };
+    if (writev(fd, iov, 2) != (ssize_t)(sizeof(h) + n)) {
+        lerror("CAPTURE: write failed, capture stopped (errno=%d %s)", errno, strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void cCapture::Record(int unit, int type, const void *data, int len) {
+    std::lock_guard<std::mutex> lock(m);
+    if (fd != -1 && len > 0)
+        append(unit, type, data, len);
+}
+
+bool cCaptureReader::Open(const std::string &path) {
+    struct stat st;
+    uint32_t h[2];
+
+    Close();
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        lerror("CAPTURE: Unable to open %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        Close();
+        return false;
+    }
+    if (st.st_size < CAPTURE_HEADER || read(fd, h, sizeof(h)) != sizeof(h) ||
+        h[0] != CAPTURE_MAGIC || h[1] != CAPTURE_VERSION) {
+        lerror("CAPTURE: %s is not a capture file of this version", path.c_str());
+        Close();
+        return false;
+    }
+
+    map_len = st.st_size;
+    map = (const unsigned char*)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        lerror("CAPTURE: mmap of %s failed (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        map = NULL;
+        Close();
+        return false;
+    }
+    madvise((void*)map, map_len, MADV_SEQUENTIAL);
+    pos = CAPTURE_HEADER;
+    offset_us = 0;
+    return true;
+}
+
+void cCaptureReader::Close() {
+    if (map)
+        munmap((void*)map, map_len);
+    if (fd != -1)
+        close(fd);
+    map = NULL;
+    fd = -1;
+}
+
+bool cCaptureReader::Next(CaptureRecord *r) {
+    while (map && pos + RECORD_HEADER <= map_len) {
+        const unsigned char *p = map + pos;
+        uint16_t n;
+
+        memcpy(&r->time_us, p, 8);
+        memcpy(&n, p + 8, 2);
+        r->len = n;
+        r->unit = p[10];
+        r->type = p[11];
+        r->data = p + RECORD_HEADER;
+        if (pos + RECORD_HEADER + n > map_len)
+            break;
+        pos += RECORD_HEADER + n;
+
+        if (r->type == CAP_OPEN && n == 8) {
+            int64_t realtime;
+            memcpy(&realtime, r->data, 8);
+            offset_us = realtime - r->time_us;
+            continue;
+        }
+        r->realtime_ms = (r->time_us + offset_us) / 1000;
+        return true;
+    }
+    if (map && pos != map_len)
+        lwarn("CAPTURE: %zu bytes of a torn record at the end ignored", map_len - pos);
+    pos = map_len;
+    return false;
+}
@@ -0,0 +1,70 @@
+#ifndef ___CAPTURE_H
+#define ___CAPTURE_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+// Capture file: an append-only log of the raw bytes written to and read from the inverters,
+// for reproducing field problems offline (inverter_poller -R <file>).
+//
+// A 16 byte file header (uint32 magic "INVC", uint32 version, 8 reserved) is followed by
+// records of a 12 byte header - int64 monotonic time (us), uint16 length, uint8 unit,
+// uint8 type - and 'length' bytes of data, all little endian.  TX records hold a whole
+// command frame, RX records each chunk as read() returned it, so a replay sees the same
+// fragmentation and garbage the decoder saw.  Every time the file is opened for writing an
+// OPEN record (data: int64 unix time, us) ties the monotonic times that follow to the wall
+// clock.  Records are appended with one write() each; a crash can only tear the last one.
+
+enum {
+    CAP_TX   = 0,
+    CAP_RX   = 1,
+    CAP_OPEN = 2
+};
+
+struct CaptureRecord {
+    int64_t time_us;            // monotonic
+    int64_t realtime_ms;        // unix time of the record, from the latest OPEN record
+    int unit;
+    int type;                   // CAP_*
+    int len;
+    const unsigned char *data;  // points into the mapped file
+};
+
+class cCapture {
+    int fd;
+    std::mutex m;
+
+    bool append(int unit, int type, const void *data, int len);
+
+    public:
+        cCapture() : fd(-1) {}
+        ~cCapture() { Close(); }
+
+        bool Open(const std::string &path);
+        void Close();
+        bool IsOpen() const { return fd != -1; }
+
+        // Appends a CAP_TX or CAP_RX record; any thread
+        void Record(int unit, int type, const void *data, int len);
+};
+
+class cCaptureReader {
+    int fd;
+    const unsigned char *map;
+    size_t map_len;
+    size_t pos;
+    int64_t offset_us;          // unix time - monotonic time, from the latest OPEN record
+
+    public:
+        cCaptureReader() : fd(-1), map(NULL), map_len(0), pos(0), offset_us(0) {}
+        ~cCaptureReader() { Close(); }
+
+        bool Open(const std::string &path);
+        void Close();
+
+        // The next TX or RX record, false at the end of the file
+        bool Next(CaptureRecord *r);
+};
+
+#endif // ___CAPTURE_H
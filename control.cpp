@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+#include "tools.h"
+
+#define CONTROL_PREFIX "inverter_poller:"
+
+// Abstract socket address for a device ("\0inverter_poller:/dev/ttyUSB0")
+static socklen_t control_addr(const std::string &device, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s%s", CONTROL_PREFIX, device.c_str());
+    if (n > (int)sizeof(addr->sun_path) - 1)
+        n = sizeof(addr->sun_path) - 1;
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+cControlServer::cControlServer() {
+    if (pipe2(stop_pipe, O_CLOEXEC) == -1)
+        stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+cControlServer::~cControlServer() {
+    Stop();
+    for (size_t i = 0; i < fds.size(); i++)
+        close(fds[i]);
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+}
+
+bool cControlServer::Listen(cInverter *ups) {
+    struct sockaddr_un addr;
+    socklen_t len = control_addr(ups->Device(), &addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, len) == -1 || listen(fd, 8) == -1) {
+        lerror("CONTROL: Unable to listen for %s (errno=%d %s)", ups->Device().c_str(), errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    fds.push_back(fd);
+    units.push_back(ups);
+    return true;
+}
+
+void cControlServer::Stop() {
+    if (!t1.joinable())
+        return;
+    if (write(stop_pipe[1], "x", 1) != 1)
+        lerror("CONTROL: Unable to wake server thread");
+    t1.join();
+}
+
+void cControlServer::serve() {
+    std::vector<struct pollfd> pfds(fds.size() + 1);
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    pfds[fds.size()].fd = stop_pipe[0];
+    pfds[fds.size()].events = POLLIN;
+
+    while (true) {
+        if (::poll(pfds.data(), pfds.size(), -1) == -1 && errno != EINTR)
+            break;
+        if (pfds[fds.size()].revents)
+            break;
+
+        reap(false);
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            int client = accept4(fds[i], NULL, NULL, SOCK_CLOEXEC);
+            if (client == -1)
+                continue;
+            if (sessions.size() >= MAX_SESSIONS) {
+                dprintf(client, "ERR busy\n");
+                close(client);
+                continue;
+            }
+            Session *s = new Session;
+            s->fd = client;
+            cInverter *ups = units[i];
+            s->t = std::thread([this, s, ups] {
+                handle(s->fd, ups);
+                shutdown(s->fd, SHUT_RDWR);     // the client sees EOF now, close() waits for reap()
+                s->done = true;
+            });
+            sessions.push_back(s);
+        }
+    }
+    reap(true);
+}
+
+// Joins finished sessions; with 'all' ends the running ones first
+void cControlServer::reap(bool all) {
+    for (std::list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ) {
+        Session *s = *it;
+        if (!all && !s->done) {
+            ++it;
+            continue;
+        }
+        if (all)
+            shutdown(s->fd, SHUT_RDWR);     // wakes a read(); a queued command still completes
+        s->t.join();
+        close(s->fd);
+        delete s;
+        it = sessions.erase(it);
+    }
+}
+
+void cControlServer::handle(int client, cInverter *ups) {
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    char buf[1024];
+    int n = 0;
+
+    // Abstract sockets have no file permissions: only accept our own user (or root)
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+        (cred.uid != 0 && cred.uid != geteuid())) {
+        dprintf(client, "ERR permission denied\n");
+        return;
+    }
+
+    // A session may carry any number of commands; don't let a silent client hang the server
+    struct timeval tv = { 5, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (true) {
+        char *eol = (char*)memchr(buf, '\n', n);
+        if (!eol) {
+            if (n == (int)sizeof(buf)) {
+                dprintf(client, "ERR line too long\n");
+                return;
+            }
+            int r = read(client, buf + n, sizeof(buf) - n);
+            if (r <= 0)
+                return;
+            n += r;
+            continue;
+        }
+
+        *eol = 0;
+        std::string line(buf);
+        n -= eol + 1 - buf;
+        memmove(buf, eol + 1, n);
+
+        line.erase(line.find_last_not_of("\r ") + 1);
+        if (line.empty())
+            continue;
+
+        // Optional leading priority: "<priority> <command>"
+        int priority = cInverter::RAW_PRIORITY;
+        int consumed = 0;
+        if (sscanf(line.c_str(), "%d %n", &priority, &consumed) == 1 && consumed)
+            line.erase(0, consumed);
+        if (line.empty() || line.find(' ') != std::string::npos) {
+            dprintf(client, "ERR bad command\n");
+            continue;
+        }
+
+        lprintf("CONTROL: %s: %s (priority %d)", ups->Device().c_str(), line.c_str(), priority);
+        std::string reply;
+        if (ups->Submit(line, reply, priority))
+            dprintf(client, "OK %s\n", reply.c_str());
+        else
+            dprintf(client, "ERR no reply\n");
+    }
+}
+
+bool control_send(const std::string &device, const std::string &cmd, int priority, std::string &reply, bool *served) {
+    struct sockaddr_un addr;
+    socklen_t len = control_addr(device, &addr);
+
+    *served = false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    if (connect(fd, (struct sockaddr*)&addr, len) == -1) {
+        close(fd);
+        return false;
+    }
+    *served = true;
+
+    // Anyone can bind an abstract name first: only talk to a poller of our own user (or root),
+    // a squatter must not see our commands nor answer them
+    struct ucred cred = { 0, (uid_t)-1, (gid_t)-1 };
+    socklen_t credlen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+        (cred.uid != 0 && cred.uid != geteuid())) {
+        close(fd);
+        reply = "control socket of " + device + " is not served by our user or root, refusing to use it";
+        lerror("CONTROL: %s (uid %d)", reply.c_str(), (int)cred.uid);
+        return false;
+    }
+
+    struct timeval tv = { 15, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    dprintf(fd, "%d %s\n", priority, cmd.c_str());
+    shutdown(fd, SHUT_WR);      // single command, the server closes after replying
+
+    char line[512];
+    int n = 0, r;
+    while (n < (int)sizeof(line) - 1 && (r = read(fd, line + n, sizeof(line) - 1 - n)) > 0)
+        n += r;
+    close(fd);
+    line[n] = 0;
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (strncmp(line, "OK ", 3) == 0) {
+        reply = line + 3;
+        return true;
+    }
+    // "ERR <reason>", or nothing at all within the timeout
+    reply = strncmp(line, "ERR ", 4) == 0 ? line + 4 : "no answer from the poller";
+    lprintf("CONTROL: %s: %s", cmd.c_str(), reply.c_str());
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef ___CONTROL_H
+#define ___CONTROL_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "inverter.h"
+
+// Local control socket, one per inverter.
+// Lets other processes (inverter_poller -r, scripts...) run raw commands through the poller
+// that already owns the serial port, instead of waiting for it to exit.
+// The sockets live in the abstract namespace, named after the device path, so a client only
+// needs to know which device it wants to talk to.
+//
+// Protocol: line based, any number of commands per connection.  Each line is
+// "[<priority>] <command>\n" and is answered with "OK <reply>\n" or "ERR <reason>\n".
+// The command is queued into the poller and sent ahead of any scheduled query with a
+// lower priority (default priority: cInverter::RAW_PRIORITY, i.e. before all of them).
+// From a shell:  socat - ABSTRACT-CONNECT:inverter_poller:/dev/ttyUSB0
+//
+// Every connection gets its own thread, so a long session never holds up other clients.
+
+class cControlServer {
+    struct Session {
+        int fd;
+        std::thread t;
+        std::atomic_bool done{false};
+    };
+
+    std::vector<int> fds;
+    std::vector<cInverter*> units;
+    std::list<Session*> sessions;       // serve() thread only
+    int stop_pipe[2];
+    std::thread t1;
+
+    void serve();
+    void reap(bool all);
+    void handle(int client, cInverter *ups);
+
+    public:
+        cControlServer();
+        ~cControlServer();
+
+        bool Listen(cInverter *ups);
+        void Start() { t1 = std::thread(&cControlServer::serve, this); }
+        void Stop();
+
+        static const int MAX_SESSIONS = 16;
+};
+
+// Client side: true with the reply, false with the reason in 'reply'.  '*served' is false if
+// no poller is serving 'device' (the caller may then open it itself).
+bool control_send(const std::string &device, const std::string &cmd, int priority, std::string &reply, bool *served);
+
+#endif // ___CONTROL_H
@@ -0,0 +1,53 @@
+#include <array>
+#include "crc.h"
+
+typedef std::array<std::array<uint16_t, 256>, 8> crc_tables;
+
+// T[0][b] is the CRC of byte b; T[k][b] is the CRC of byte b followed by k zero bytes
+static constexpr crc_tables make_tables() {
+    crc_tables t{};
+
+    for (int b = 0; b < 256; b++) {
+        uint16_t crc = b << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        t[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int b = 0; b < 256; b++)
+            t[k][b] = (t[k-1][b] << 8) ^ t[0][t[k-1][b] >> 8];
+    return t;
+}
+
+static constexpr crc_tables T = make_tables();
+
+static inline uint16_t crc16_bytes(uint16_t crc, const uint8_t *p, size_t len) {
+    while (len--)
+        crc = (crc << 8) ^ T[0][(crc >> 8) ^ *p++];
+    return crc;
+}
+
+uint16_t crc16_table(const uint8_t *data, size_t len) {
+    return crc16_bytes(0, data, len);
+}
+
+uint16_t crc16_slice4(const uint8_t *p, size_t len) {
+    uint16_t crc = 0;
+
+    for (; len >= 4; len -= 4, p += 4) {
+        crc = T[3][p[0] ^ (crc >> 8)] ^ T[2][p[1] ^ (crc & 0xff)] ^
+              T[1][p[2]] ^ T[0][p[3]];
+    }
+    return crc16_bytes(crc, p, len);
+}
+
+uint16_t crc16_slice8(const uint8_t *p, size_t len) {
+    uint16_t crc = 0;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        crc = T[7][p[0] ^ (crc >> 8)] ^ T[6][p[1] ^ (crc & 0xff)] ^
+              T[5][p[2]] ^ T[4][p[3]] ^ T[3][p[4]] ^ T[2][p[5]] ^
+              T[1][p[6]] ^ T[0][p[7]];
+    }
+    return crc16_bytes(crc, p, len);
+}
@@ -0,0 +1,33 @@
+#ifndef ___CRC_H
+#define ___CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-16/XMODEM (poly 0x1021, init 0, MSB first) as used by the Voltronic protocol.
+// The lookup tables are generated at compile time.  crc16_table() is the classic
+// one-table-lookup-per-byte version, crc16_slice4/8() consume 4/8 bytes per step.
+
+uint16_t crc16_table(const uint8_t *data, size_t len);
+uint16_t crc16_slice4(const uint8_t *data, size_t len);
+uint16_t crc16_slice8(const uint8_t *data, size_t len);
+
+// The inverter never sends 0x28 '(', 0x0d CR or 0x0a LF as a CRC byte - such bytes are
+// incremented by one, on both sides of the link.
+static inline uint16_t crc_escape(uint16_t crc) {
+    uint8_t hi = crc >> 8;
+    uint8_t lo = crc & 0xff;
+
+    if (hi == 0x28 || hi == 0x0d || hi == 0x0a)
+        hi++;
+    if (lo == 0x28 || lo == 0x0d || lo == 0x0a)
+        lo++;
+    return ((uint16_t)hi << 8) | lo;
+}
+
+// CRC of a command/reply payload as it goes on the wire
+static inline uint16_t cal_crc(const uint8_t *data, size_t len) {
+    return crc_escape(crc16_slice8(data, len));
+}
+
+#endif // ___CRC_H
@@ -0,0 +1,121 @@
+#include <string.h>
+#include "decoder.h"
+#include "crc.h"
+
+void cFrameDecoder::Reset() {
+    head = tail = scan = 0;
+    state = HUNT;
+}
+
+void cFrameDecoder::Feed(const unsigned char *data, int len) {
+    if (len >= RING_SIZE) {
+        data += len - RING_SIZE;
+        len = RING_SIZE;
+    }
+    if (Buffered() + len > RING_SIZE) {
+        // Overrun: whatever frame was in progress has lost its start
+        tail = head + len - RING_SIZE;
+        scan = tail;
+        state = HUNT;
+    }
+
+    uint32_t pos = head & (RING_SIZE - 1);
+    int first = len < RING_SIZE - (int)pos ? len : RING_SIZE - pos;
+    memcpy(ring + pos, data, first);
+    memcpy(ring, data + first, len - first);
+    head += len;
+}
+
+// frame_buf[0..n) holds '(' payload CRC-hi CRC-lo
+bool cFrameDecoder::crc_ok(int n) const {
+    if (n < 3)
+        return false;
+    uint16_t crc = cal_crc(frame_buf, n - 2);
+    return frame_buf[n - 2] == (crc >> 8) && frame_buf[n - 1] == (crc & 0xff);
+}
+
+int cFrameDecoder::Next(const unsigned char **frame, int *len) {
+    if (state == HUNT) {
+        uint32_t from = tail;
+        while (tail != head && at(tail) != '(')
+            tail++;
+        scan = tail;
+        if (tail != from) {
+            *len = tail - from;
+            return GARBAGE;
+        }
+        if (tail == head)
+            return MORE;
+        state = BODY;
+        scan = tail + 1;
+    }
+
+    // BODY: look for the CR, incrementally across calls.  The length check comes first so it
+    // also covers the CR: a frame is at most FRAME_MAX bytes, CR included.
+    while (scan != head) {
+        if (scan - tail >= FRAME_MAX) {
+            // No CR within any sane frame length: drop up to the next '(' seen on the way
+            uint32_t from = tail;
+            do
+                tail++;
+            while (tail != scan && at(tail) != '(');
+            scan = tail;
+            state = HUNT;
+            *len = tail - from;
+            return GARBAGE;
+        }
+        if (at(scan) == 0x0d)
+            break;
+        scan++;
+    }
+    if (scan == head)
+        return MORE;
+
+    int n = scan - tail + 1;
+    for (int i = 0; i < n; i++)
+        frame_buf[i] = at(tail + i);
+    frame_buf[n] = 0;
+
+    if (n < 4 || !crc_ok(n - 1)) {
+        // Resync on the next '(' inside the rejected frame - a reply that lost its CR is
+        // followed by a complete one
+        do
+            tail++;
+        while (tail != scan + 1 && at(tail) != '(');
+        scan = tail;
+        state = HUNT;
+        *frame = frame_buf;
+        *len = n;
+        return BAD_CRC;
+    }
+
+    tail = scan = scan + 1;
+    state = HUNT;
+    *frame = frame_buf;
+    *len = n;
+    return FRAME;
+}
+
+int cFrameDecoder::Flush(const unsigned char **frame, int *len) {
+    if (state != BODY || head == tail)
+        return MORE;
+
+    int n = head - tail;
+    if (n > FRAME_MAX - 1)
+        n = FRAME_MAX - 1;
+    for (int i = 0; i < n; i++)
+        frame_buf[i] = at(tail + i);
+    tail = scan = head;
+    state = HUNT;
+    *frame = frame_buf;
+
+    if (!crc_ok(n)) {
+        frame_buf[n] = 0;
+        *len = n;
+        return BAD_CRC;
+    }
+    frame_buf[n++] = 0x0d;
+    frame_buf[n] = 0;
+    *len = n;
+    return FRAME;
+}
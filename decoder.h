@@ -0,0 +1,59 @@
+#ifndef ___DECODER_H
+#define ___DECODER_H
+
+#include <stdint.h>
+
+// Incremental decoder for reply frames: '(' payload CRC-hi CRC-lo CR.
+// Bytes are fed in whatever pieces read() returns and kept in a ring buffer; Next() runs a
+// two state machine over them:
+//   HUNT  skip everything up to a '(' start byte
+//   BODY  collect up to the CR, then check length and CRC
+// A frame that fails its CRC is not thrown away as a whole: the search restarts right after
+// its '(' so a good frame hidden behind noise or behind a reply that lost its CR is found
+// straight away.  The CRC bytes never take the values '(' or CR, so they cannot fake either.
+
+class cFrameDecoder {
+    public:
+        static const int RING_SIZE = 2048;      // power of two
+        static const int FRAME_MAX = 1024;      // longest frame, CR included; longer runs are garbage
+
+        enum { MORE, FRAME, GARBAGE, BAD_CRC };
+
+        cFrameDecoder() { Reset(); }
+
+        // Forgets every buffered byte, e.g. when a new command goes out
+        void Reset();
+
+        // Appends received bytes; when the ring is full the oldest bytes are dropped
+        void Feed(const unsigned char *data, int len);
+
+        // Advances the state machine by one event:
+        //   FRAME    *frame/*len hold a complete, CRC checked frame (incl. '(' CRC and CR,
+        //            NUL terminated), valid until the next call
+        //   GARBAGE  *len bytes were skipped while looking for a frame
+        //   BAD_CRC  like FRAME, but the frame failed its checks and was skipped
+        //   MORE     nothing left to decode, feed more bytes
+        int Next(const unsigned char **frame, int *len);
+
+        // The line went quiet with a frame in progress: if it ends in a good CRC it only lost
+        // its CR and is returned as FRAME (with the CR put back), otherwise it is dropped as
+        // BAD_CRC.  MORE when nothing was pending.
+        int Flush(const unsigned char **frame, int *len);
+
+        int Buffered() const { return head - tail; }
+
+    private:
+        enum { HUNT, BODY };
+
+        unsigned char ring[RING_SIZE];
+        unsigned char frame_buf[FRAME_MAX + 1];
+        uint32_t head;          // write position (free running, masked on access)
+        uint32_t tail;          // oldest byte still needed; the '(' while in BODY
+        uint32_t scan;          // next byte to look at
+        int state;
+
+        unsigned char at(uint32_t pos) const { return ring[pos & (RING_SIZE - 1)]; }
+        bool crc_ok(int n) const;
+};
+
+#endif // ___DECODER_H
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "energy.h"
+#include "tools.h"
+
+static int local_day(int64_t unix_ms) {
+    time_t t = unix_ms / 1000;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+cEnergy::cEnergy() : day(0), have_last(false), last_time(0) {
+    memset(&total, 0, sizeof(total));
+    memset(&today, 0, sizeof(today));
+    memset(&last_power, 0, sizeof(last_power));
+}
+
+void cEnergy::Update(Sample &s) {
+    EnergyCounters power;
+    power.pv = s.pv_input_watts;
+    power.load = s.qpigs.load_watt;
+    power.batt_in = s.qpigs.batt_voltage * s.qpigs.batt_charge_current;
+    power.batt_out = s.qpigs.batt_voltage * s.qpigs.batt_discharge_current;
+
+    int d = local_day(s.timestamp);
+    if (d != day) {
+        if (day)
+            linfo("ENERGY: Unit %d day %d: PV %.1f Wh, load %.1f Wh, battery in %.1f Wh, out %.1f Wh",
+                  s.unit, day, today.pv, today.load, today.batt_in, today.batt_out);
+        memset(&today, 0, sizeof(today));
+        day = d;
+    }
+
+    EnergyCounters delta;
+    memset(&delta, 0, sizeof(delta));
+    int64_t dt = s.monotonic - last_time;
+    if (have_last && dt > 0 && dt <= ENERGY_MAX_GAP) {
+        double hours = dt / 3600000.0;
+        delta.pv = (last_power.pv + power.pv) / 2 * hours;
+        delta.load = (last_power.load + power.load) / 2 * hours;
+        delta.batt_in = (last_power.batt_in + power.batt_in) / 2 * hours;
+        delta.batt_out = (last_power.batt_out + power.batt_out) / 2 * hours;
+    } else if (have_last && dt > ENERGY_MAX_GAP) {
+        lwarn("ENERGY: Unit %d: no sample for %lld s, not counting that gap", s.unit, (long long)dt / 1000);
+    }
+    if (dt != 0 || !have_last) {
+        have_last = true;
+        last_time = s.monotonic;
+        last_power = power;
+    }
+
+    total.pv += delta.pv;
+    total.load += delta.load;
+    total.batt_in += delta.batt_in;
+    total.batt_out += delta.batt_out;
+    today.pv += delta.pv;
+    today.load += delta.load;
+    today.batt_in += delta.batt_in;
+    today.batt_out += delta.batt_out;
+
+    s.pv_input_watthour = delta.pv;
+    s.load_watthour = delta.load;
+    s.total = total;
+    s.today = today;
+}
+
+bool cEnergy::Load(const std::string &path, std::vector<cEnergy> &units) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f) {
+        if (errno != ENOENT)
+            lerror("ENERGY: Unable to read %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned unit;
+        cEnergy e;
+        if (sscanf(line, "%u %d %lf %lf %lf %lf %lf %lf %lf %lf", &unit, &e.day,
+                   &e.total.pv, &e.total.load, &e.total.batt_in, &e.total.batt_out,
+                   &e.today.pv, &e.today.load, &e.today.batt_in, &e.today.batt_out) != 10) {
+            lwarn("ENERGY: Ignoring malformed line in %s", path.c_str());
+            continue;
+        }
+        if (unit < units.size())
+            units[unit] = e;
+    }
+    fclose(f);
+    return true;
+}
+
+bool cEnergy::Save(const std::string &path, const std::vector<cEnergy> &units) {
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        lerror("ENERGY: Unable to write %s (errno=%d %s)", tmp.c_str(), errno, strerror(errno));
+        return false;
+    }
+
+    for (size_t u = 0; u < units.size(); u++) {
+        const cEnergy &e = units[u];
+        fprintf(f, "%zu %d %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", u, e.day,
+                e.total.pv, e.total.load, e.total.batt_in, e.total.batt_out,
+                e.today.pv, e.today.load, e.today.batt_in, e.today.batt_out);
+    }
+
+    // Data on disk before the rename, so a power cut leaves either the old or the new file
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) == -1) {
+        lerror("ENERGY: Unable to save %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef ___ENERGY_H
+#define ___ENERGY_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "output.h"
+
+// Energy accounting for one inverter.
+// Power is integrated over the monotonic time the QPIGS replies were read (trapezoidal rule),
+// so the result follows the real sample spacing instead of a configured interval.  Gaps longer
+// than ENERGY_MAX_GAP (poller stopped, inverter unreachable) are not bridged.
+// Cumulative and daily counters survive restarts through a small state file, rewritten
+// atomically (temp file + rename) every ENERGY_SAVE_INTERVAL and at exit.
+
+#define ENERGY_MAX_GAP       300000     // ms
+#define ENERGY_SAVE_INTERVAL 60         // s
+
+class cEnergy {
+    EnergyCounters total;
+    EnergyCounters today;
+    int day;                    // local date of 'today', yyyymmdd
+
+    bool have_last;
+    int64_t last_time;          // monotonic ms
+    EnergyCounters last_power;  // W, at last_time
+
+    public:
+        cEnergy();
+
+        // Integrates up to this sample and fills in its energy fields
+        void Update(Sample &s);
+
+        // State file: one line per unit "<unit> <day> <4 total counters> <4 today counters>"
+        static bool Load(const std::string &path, std::vector<cEnergy> &units);
+        static bool Save(const std::string &path, const std::vector<cEnergy> &units);
+};
+
+#endif // ___ENERGY_H
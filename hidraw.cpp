@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include "hidraw.h"
+#include "tools.h"
+
+bool cHidrawPort::configure() {
+    struct hidraw_devinfo info;
+
+    report_pos = report_len = 0;        // nothing of an earlier connection is still wanted
+
+    // Nothing to set up; just make sure this really is a hidraw node
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) == -1)
+        return false;
+    lprintf("INVERTER: %s is HID device %04x:%04x", device.data(), info.vendor & 0xffff, info.product & 0xffff);
+    return true;
+}
+
+bool cHidrawPort::Write(const void *data, int len) {
+    const unsigned char *p = (const unsigned char*)data;
+
+    while (len > 0) {
+        // Report number 0 first: the device has no numbered reports, the kernel strips it.
+        // Without it a chunk starting with a 0x00 CRC byte would lose that byte.
+        unsigned char report[REPORT_SIZE + 1];
+        int n = len < REPORT_SIZE ? len : REPORT_SIZE;
+        memset(report, 0, sizeof(report));
+        memcpy(report + 1, p, n);
+
+        int w = write(fd, report, sizeof(report));
+        if (w < 0 && (errno == EINTR || errno == EAGAIN)) {
+            if (wait(POLLOUT, WRITE_TIMEOUT) <= 0) {
+                lwarn("INVERTER: %s does not take reports", device.data());
+                if (IsOpen())
+                    Disconnect();
+                return false;
+            }
+            continue;
+        }
+        if (w != (int)sizeof(report)) {
+            lwarn("INVERTER: write to %s failed (n=%d errno=%d %s)", device.data(), w, errno, strerror(errno));
+            Disconnect();
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Hands out what is left of the last report
+int cHidrawPort::take(unsigned char *out, int len) {
+    int n = report_len - report_pos < len ? report_len - report_pos : len;
+    memcpy(out, report + report_pos, n);
+    report_pos += n;
+    return n;
+}
+
+// Takes every report that is already queued, not just the first one, for as much as fits
+int cHidrawPort::Read(void *data, int len, int timeout_ms) {
+    unsigned char *out = (unsigned char*)data;
+
+    if (len <= 0)
+        return 0;
+    int got = take(out, len);
+    if (!got) {
+        int r = wait(POLLIN, timeout_ms);
+        if (r <= 0)
+            return r;
+    }
+
+    while (got < len) {
+        int n = read(fd, report, sizeof(report));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            lwarn("INVERTER: read from %s failed (n=%d errno=%d %s)", device.data(), n, errno, strerror(errno));
+            report_pos = report_len = 0;
+            Disconnect();
+            return -1;
+        }
+
+        // The report holding the CR is zero padded behind it
+        unsigned char *cr = (unsigned char*)memchr(report, 0x0d, n);
+        report_pos = 0;
+        report_len = cr ? cr - report + 1 : n;
+        got += take(out + got, len - got);
+    }
+    return got;
+}
+
+void cHidrawPort::FlushInput() {
+    while (read(fd, report, sizeof(report)) > 0)
+        ;
+    report_pos = report_len = 0;
+}
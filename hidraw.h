@@ -0,0 +1,34 @@
+#ifndef ___HIDRAW_H
+#define ___HIDRAW_H
+
+#include "transport.h"
+
+// The inverter's own USB port, seen as a HID device through /dev/hidraw*.
+// Data goes both ways in 8 byte reports: a command is cut into reports (the last one zero
+// padded), and every read() returns exactly one report, of which only the part up to the
+// CR is reply data.  There is no termios and no kernel byte queue to flush.
+// A report is read whole; what does not fit the caller's buffer is kept for the next Read().
+
+class cHidrawPort : public cTransport {
+    public:
+        static const int REPORT_SIZE = 8;
+        static const int REPORT_MAX = 64;       // largest report a full speed device can send
+        static const int WRITE_TIMEOUT = 1000;  // ms per report
+
+    private:
+        unsigned char report[REPORT_MAX];       // last report read, reply data only
+        int report_pos;                         // next byte to hand out
+        int report_len;
+
+        bool configure();
+        int take(unsigned char *out, int len);
+
+    public:
+        cHidrawPort(std::string devicename) : cTransport(devicename), report_pos(0), report_len(0) {}
+
+        bool Write(const void *data, int len);
+        int Read(void *data, int len, int timeout_ms);
+        void FlushInput();
+};
+
+#endif // ___HIDRAW_H
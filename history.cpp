@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "crc.h"
+#include "tools.h"
+
+#define HISTORY_MAGIC   0x48564e49      // "INVH"
+#define HISTORY_VERSION 1
+
+struct HistoryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t values;
+    uint64_t capacity;
+    uint64_t clock_step;        // seq of the newest record older in time than the one before it
+    char reserved[32];
+};
+
+const char *history_fields[HISTORY_VALUES] = {
+    "AC_grid_voltage", "AC_grid_frequency", "AC_out_voltage", "AC_out_frequency",
+    "Load_va", "Load_watt", "Load_pct", "Bus_voltage",
+    "Battery_voltage", "Battery_charge_current", "Battery_discharge_current", "Battery_capacity",
+    "Heatsink_temperature", "PV_in_current", "PV_in_voltage", "PV_in_watts",
+};
+
+static uint16_t record_crc(const HistoryRecord *r) {
+    HistoryRecord tmp = *r;
+    tmp.crc = 0;
+    return crc16_slice8((const uint8_t*)&tmp, sizeof(tmp));
+}
+
+cHistory::cHistory() : fd(-1), writable(false), map(NULL), map_len(0), hdr(NULL), rec(NULL),
+                       capacity(0), head(0), synced(0), sync_every(30) {}
+
+cHistory::~cHistory() {
+    Close();
+}
+
+bool cHistory::map_file(const std::string &path, uint64_t records) {
+    struct stat st;
+
+    fd = open(path.c_str(), (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        lerror("HISTORY: Unable to open %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        Close();
+        return false;
+    }
+
+    if (st.st_size == 0 && writable) {
+        // New store: header first, then the (sparse) record area
+        HistoryHeader h;
+        memset(&h, 0, sizeof(h));
+        h.magic = HISTORY_MAGIC;
+        h.version = HISTORY_VERSION;
+        h.record_size = sizeof(HistoryRecord);
+        h.values = HISTORY_VALUES;
+        h.capacity = records;
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+            ftruncate(fd, sizeof(h) + records * sizeof(HistoryRecord)) == -1 || fsync(fd) == -1) {
+            lerror("HISTORY: Unable to create %s (errno=%d %s)", path.c_str(), errno, strerror(errno));
+            Close();
+            return false;
+        }
+        st.st_size = sizeof(h) + records * sizeof(HistoryRecord);
+    }
+
+    HistoryHeader h;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != HISTORY_MAGIC ||
+        h.version != HISTORY_VERSION || h.record_size != sizeof(HistoryRecord) ||
+        h.values != HISTORY_VALUES || h.capacity == 0 ||
+        (uint64_t)st.st_size < sizeof(h) + h.capacity * sizeof(HistoryRecord)) {
+        lerror("HISTORY: %s is not a history file of this version, not touching it", path.c_str());
+        Close();
+        return false;
+    }
+
+    map_len = sizeof(h) + h.capacity * sizeof(HistoryRecord);
+    map = (char*)mmap(NULL, map_len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        lerror("HISTORY: mmap of %s failed (errno=%d %s)", path.c_str(), errno, strerror(errno));
+        map = NULL;
+        Close();
+        return false;
+    }
+    hdr = (HistoryHeader*)map;
+    rec = (HistoryRecord*)(map + sizeof(HistoryHeader));
+    capacity = hdr->capacity;
+    if (records && records != capacity)
+        lwarn("HISTORY: %s holds %llu records, keeping that size", path.c_str(), (unsigned long long)capacity);
+    recover();
+    return true;
+}
+
+// The newest valid record tells where the ring continues; nothing else is stored
+void cHistory::recover() {
+    head = 0;
+    for (uint64_t i = 0; i < capacity; i++)
+        if (Valid(&rec[i]) && rec[i].seq > head)
+            head = rec[i].seq;
+    synced = head;
+}
+
+bool cHistory::Open(const std::string &path, uint64_t records) {
+    Close();
+    writable = true;
+    if (!map_file(path, records))
+        return false;
+    linfo("HISTORY: %s opened, %llu of %llu records used", path.c_str(),
+          (unsigned long long)(head < capacity ? head : capacity), (unsigned long long)capacity);
+    return true;
+}
+
+bool cHistory::OpenReadOnly(const std::string &path) {
+    Close();
+    writable = false;
+    return map_file(path, 0);
+}
+
+void cHistory::Close() {
+    if (map) {
+        Sync();
+        munmap(map, map_len);
+    }
+    if (fd != -1)
+        close(fd);
+    fd = -1;
+    map = NULL;
+    hdr = NULL;
+    rec = NULL;
+    capacity = head = synced = 0;
+}
+
+bool cHistory::Valid(const HistoryRecord *r) {
+    return r->seq != 0 && r->crc == record_crc(r);
+}
+
+int cHistory::FieldIndex(const std::string &name) {
+    for (int i = 0; i < HISTORY_VALUES; i++)
+        if (name == history_fields[i])
+            return i;
+    return -1;
+}
+
+void cHistory::Append(const Sample &s) {
+    if (!map || !writable)
+        return;
+
+    HistoryRecord r;
+    const QpigsReply &q = s.qpigs;
+
+    memset(&r, 0, sizeof(r));
+    r.seq = head + 1;
+    r.timestamp = s.timestamp;
+    r.unit = s.unit;
+    r.mode = s.mode;
+    for (int i = 0; i < 8 && q.device_status[i]; i++)
+        r.status = (r.status << 1) | (q.device_status[i] == '1');
+    float *v = r.v;
+    *v++ = q.grid_voltage;  *v++ = q.grid_freq;     *v++ = q.out_voltage;   *v++ = q.out_freq;
+    *v++ = q.load_va;       *v++ = q.load_watt;     *v++ = q.load_percent;  *v++ = q.bus_voltage;
+    *v++ = q.batt_voltage;  *v++ = q.batt_charge_current;   *v++ = q.batt_discharge_current;
+    *v++ = q.batt_capacity; *v++ = q.heatsink_temp; *v++ = s.pv_input_current;
+    *v++ = q.pv_voltage;    *v++ = s.pv_input_watts;
+    r.crc = record_crc(&r);
+
+    // The wall clock went backwards (NTP step, manual change): the ring is no longer sorted by
+    // time until this record is the oldest one left.  The header goes to disk first, so a
+    // reader never sees the record without the mark.
+    const HistoryRecord *prev = head ? slot(head) : NULL;
+    if (prev && Valid(prev) && prev->seq == head && r.timestamp < prev->timestamp) {
+        lwarn("HISTORY: Clock went back by %lld ms, range queries scan the whole ring for a while",
+              (long long)(prev->timestamp - r.timestamp));
+        hdr->clock_step = r.seq;
+        if (msync(map, sizeof(HistoryHeader), MS_SYNC) == -1)
+            lerror("HISTORY: msync failed (errno=%d %s)", errno, strerror(errno));
+    }
+
+    memcpy(&rec[(r.seq - 1) % capacity], &r, sizeof(r));
+    head = r.seq;
+
+    if (sync_every > 0 && head - synced >= (uint64_t)sync_every)
+        Sync();
+}
+
+void cHistory::Sync() {
+    if (!map || !writable || synced == head)
+        return;
+
+    // msync() wants page aligned ranges; the header page is never dirty, the ring may wrap
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t from = head - synced > capacity ? head - capacity : synced;
+    uint64_t a = from % capacity;
+    uint64_t b = (head - 1) % capacity + 1;
+
+    auto sync_range = [&](uint64_t first, uint64_t last) {
+        size_t start = sizeof(HistoryHeader) + first * sizeof(HistoryRecord);
+        size_t end = sizeof(HistoryHeader) + last * sizeof(HistoryRecord);
+        start -= start % page;
+        if (msync(map + start, end - start, MS_SYNC) == -1)
+            lerror("HISTORY: msync failed (errno=%d %s)", errno, strerror(errno));
+    };
+    if (a < b)
+        sync_range(a, b);
+    else {
+        sync_range(a, capacity);
+        sync_range(0, b);
+    }
+    synced = head;
+}
+
+uint64_t cHistory::oldest() const {
+    return head > capacity ? head - capacity + 1 : 1;
+}
+
+// Timestamps grow with the sequence number, unless a record written after the clock went
+// back is still in the ring
+bool cHistory::sorted() const {
+    return hdr->clock_step <= oldest();
+}
+
+// Oldest sequence number with timestamp >= from; the oldest of all when the ring is not sorted
+uint64_t cHistory::first_at(int64_t from) const {
+    uint64_t lo = oldest();
+    uint64_t hi = head + 1;
+
+    if (!sorted())
+        return lo;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (slot(mid)->timestamp < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void cHistory::Query(int unit, int64_t from, int64_t to, std::vector<HistoryRecord> &out) const {
+    out.clear();
+    if (!map)
+        return;
+    bool in_order = sorted();
+    for (uint64_t seq = first_at(from); seq <= head; seq++) {
+        const HistoryRecord *r = slot(seq);
+        if (r->seq != seq || !Valid(r))
+            continue;
+        if (r->timestamp >= to) {
+            if (in_order)
+                break;
+            continue;
+        }
+        if (r->timestamp >= from && r->unit == unit)
+            out.push_back(*r);
+    }
+}
+
+void cHistory::Downsample(int unit, int field, int64_t from, int64_t to, int64_t bucket_ms,
+                          std::vector<HistoryBucket> &out) const {
+    out.clear();
+    if (!map || field < 0 || field >= HISTORY_VALUES || bucket_ms <= 0)
+        return;
+    bool in_order = sorted();
+    for (uint64_t seq = first_at(from); seq <= head; seq++) {
+        const HistoryRecord *r = slot(seq);
+        if (r->seq != seq || !Valid(r))
+            continue;
+        if (r->timestamp >= to) {
+            if (in_order)
+                break;
+            continue;
+        }
+        if (r->timestamp < from || r->unit != unit)
+            continue;
+
+        float v = r->v[field];
+        int64_t start = r->timestamp - r->timestamp % bucket_ms;
+        if (out.empty() || out.back().start != start) {
+            HistoryBucket b = { start, v, v, 0, 0 };
+            out.push_back(b);
+        }
+        HistoryBucket &b = out.back();
+        if (v < b.min)
+            b.min = v;
+        if (v > b.max)
+            b.max = v;
+        b.sum += v;
+        b.count++;
+    }
+    if (in_order)
+        return;
+
+    // Out of time order the same interval can show up more than once: sort and merge
+    std::sort(out.begin(), out.end(), [](const HistoryBucket &a, const HistoryBucket &b) { return a.start < b.start; });
+    size_t n = 0;
+    for (size_t i = 0; i < out.size(); i++) {
+        if (n && out[n - 1].start == out[i].start) {
+            HistoryBucket &b = out[n - 1];
+            b.min = std::min(b.min, out[i].min);
+            b.max = std::max(b.max, out[i].max);
+            b.sum += out[i].sum;
+            b.count += out[i].count;
+        } else {
+            out[n++] = out[i];
+        }
+    }
+    out.resize(n);
+}
@@ -0,0 +1,86 @@
+#ifndef ___HISTORY_H
+#define ___HISTORY_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "output.h"
+
+// Embedded time-series store of QPIGS samples.
+// The file is a fixed header followed by a ring of fixed size records, memory mapped and
+// written in place: an append is one struct copy into the next slot, no allocation, no
+// syscall.  Every record carries its sequence number and a CRC, so after a crash or power
+// loss the store is recovered by scanning for the newest valid record; a torn write costs
+// that one record only.  Readers (inverter_poller -H) map the file read-only and can run
+// while the poller is writing.  Range queries binary search the timestamps; after the wall
+// clock was set back they scan the ring instead, until the out of order records have aged out.
+
+#define HISTORY_VALUES 16
+
+// Order of HistoryRecord::v, also the field names accepted by queries
+extern const char *history_fields[HISTORY_VALUES];
+
+struct HistoryRecord {
+    uint64_t seq;               // 1, 2, 3 ...  0 = never written
+    int64_t timestamp;          // unix time, ms
+    uint16_t unit;
+    uint8_t mode;
+    uint8_t status;             // QPIGS device_status bits
+    uint16_t reserved;
+    uint16_t crc;               // CRC-16 of the record with crc = 0
+    float v[HISTORY_VALUES];
+};
+
+struct HistoryBucket {
+    int64_t start;              // ms
+    float min;
+    float max;
+    double sum;
+    int count;
+
+    float avg() const { return count ? sum / count : 0; }
+};
+
+class cHistory {
+    int fd;
+    bool writable;
+    char *map;
+    size_t map_len;
+    struct HistoryHeader *hdr;
+    HistoryRecord *rec;
+    uint64_t capacity;
+    uint64_t head;              // seq of the newest record
+    uint64_t synced;            // records up to here have been msync()ed
+    int sync_every;
+
+    bool map_file(const std::string &path, uint64_t records);
+    void recover();
+    const HistoryRecord *slot(uint64_t seq) const { return &rec[(seq - 1) % capacity]; }
+    uint64_t oldest() const;
+    bool sorted() const;
+    uint64_t first_at(int64_t from) const;
+
+    public:
+        cHistory();
+        ~cHistory();
+
+        // Creates the file if needed; 'records' only matters for a new file
+        bool Open(const std::string &path, uint64_t records);
+        bool OpenReadOnly(const std::string &path);
+        void Close();
+
+        void Append(const Sample &s);
+        void Sync();            // flush to disk everything appended so far
+        void SyncEvery(int records) { sync_every = records; }
+
+        static int FieldIndex(const std::string &name);
+        static bool Valid(const HistoryRecord *r);
+
+        // Records of 'unit' with from <= timestamp < to, oldest first
+        void Query(int unit, int64_t from, int64_t to, std::vector<HistoryRecord> &out) const;
+        // min/max/avg of one field per 'bucket_ms' interval (aligned to multiples of it)
+        void Downsample(int unit, int field, int64_t from, int64_t to, int64_t bucket_ms,
+                        std::vector<HistoryBucket> &out) const;
+};
+
+#endif // ___HISTORY_H
@@ -1,277 +1,474 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include "inverter.h"
+#include "crc.h"
+#include "parser.h"
+#include "protocol.h"
 #include "tools.h"
 #include "main.h"
 
-#include <termios.h>
+#include <algorithm>
+#include <chrono>
 
-cInverter::cInverter(std::string devicename) {
+using namespace std::chrono;
+
+cInverter::cInverter(std::string devicename, int unitid, cNotifier &n, int protocol) : notifier(n) {
     device = devicename;
-    status1[0] = 0;
-    status2[0] = 0;
-    warnings[0] = 0;
-    mode = 0;
+    port = cTransport::Create(devicename);
+    capture = NULL;
+    replay_rx = 0;
+    pipelined = true;
+    variant = protocol;
+    unit = unitid;
+    memset(&work, 0, sizeof(work));
+
+    // Default poll schedule from the registry: live data often, ratings rarely (overridable
+    // with poll_<cmd>= in inverter.conf)
+    for (int i = 0; i < ProtoCommandCount(); i++) {
+        const ProtoCommand *pc = ProtoCommandAt(i);
+        if (pc->period && (pc->variants & variant)) {
+            sched.Add(pc->name, pc->period, pc->priority, pc->max_period);
+            add_extra(pc->name);
+        }
+    }
 }
 
-string *cInverter::GetQpigsStatus() {
-    m.lock();
-    string *result = new string(status1);
-    m.unlock();
-    return result;
+cInverter::~cInverter() {
+    delete port;
 }
 
-string *cInverter::GetQpiriStatus() {
-    m.lock();
-    string *result = new string(status2);
-    m.unlock();
-    return result;
+int cInverter::ModeNumber(char mode) {
+    return ProtoModeNumber(mode);
 }
 
-string *cInverter::GetWarnings() {
-    m.lock();
-    string *result = new string(warnings);
-    m.unlock();
-    return result;
+int cInverter::GetMode() {
+    InverterSnapshot snap;
+    shared.Load(&snap);
+    return ModeNumber(snap.mode);
 }
 
-void cInverter::SetMode(char newmode) {
-    m.lock();
-    if (mode && newmode != mode)
-        ups_status_changed = true;
-    mode = newmode;
-    m.unlock();
-}
+// Frames a command (CRC + CR) and writes it to the port
+bool cInverter::send(const char *cmd) {
+    unsigned char frame[256];
 
-int cInverter::GetMode() {
-    int result;
-    m.lock();
+    ProtoCommandText(ProtoFind(cmd), cmd, (char*)frame, sizeof(frame) - 3);
+    int n = strlen((char*)frame);
 
-    switch (mode) {
-        case 'P': result = 1;   break;  // Power_On
-        case 'S': result = 2;   break;  // Standby
-        case 'L': result = 3;   break;  // Line
-        case 'B': result = 4;   break;  // Battery
-        case 'F': result = 5;   break;  // Fault
-        case 'H': result = 6;   break;  // Power_Saving
-        default:  result = 0;   break;  // Unknown
-    }
+    // Generating CRC for a command
+    uint16_t crc = cal_crc(frame, n);
+    lprintf("INVERTER: Current CRC: %X %X", crc >> 8, crc & 0xff);
 
-    m.unlock();
-    return result;
+    frame[n++] = crc >> 8;
+    frame[n++] = crc & 0xff;
+    frame[n++] = 0x0d;
+
+    // Whatever arrived so far belongs to an earlier command
+    port->FlushInput();
+    decoder.Reset();
+
+    if (capture)
+        capture->Record(unit, CAP_TX, frame, n);
+    return port->Write(frame, n);
 }
 
-bool cInverter::query(const char *cmd) {
-    time_t started;
-    int fd;
-    int i=0, n, replysize;
+// Takes decoded frames until one is a reply to 'cmd' and puts it in buf.  'flush' first ends
+// a frame in progress that may have lost its CR.  Sets 'broken' on a CRC failure.
+bool cInverter::next_reply(const char *cmd, bool flush, bool *broken) {
+    const unsigned char *frame;
+    int len, event;
+
+    while ((event = flush ? decoder.Flush(&frame, &len) : decoder.Next(&frame, &len)) != cFrameDecoder::MORE) {
+        flush = false;
+        if (event == cFrameDecoder::GARBAGE) {
+            lprintf("INVERTER: %s: skipped %d bytes before the start byte", cmd, len);
+            stats.bad_start++;
+            continue;
+        }
+        if (event == cFrameDecoder::BAD_CRC) {
+            lprintf("INVERTER: %s: CRC Failed!  Reply size: %d  Buffer: %s ", cmd, len, frame);
+            stats.crc_errors++;
+            *broken = true;
+            continue;
+        }
 
-    fd = open(this->device.data(), O_RDWR | O_NONBLOCK);
-    if (fd == -1) {
-        lprintf("INVERTER: Unable to open device file (errno=%d %s)", errno, strerror(errno));
-        sleep(5);
-        return false;
+        memcpy(buf, frame, len - 3);
+        buf[len-3] = '\0'; //nullterminating on first CRC byte
+        if (!ProtoMatch(ProtoFind(cmd), (const char*)buf+1)) {
+            lprintf("INVERTER: %s: discarding a late reply: %s", cmd, buf);
+            stats.late_frames++;
+            continue;
+        }
+        lprintf("INVERTER: %s: %d bytes read: %s ", cmd, len, buf);
+        return true;
     }
+    return false;
+}
 
+// Reads the reply to 'cmd' into buf and checks it.  'sent' is when the command went out.
+bool cInverter::receive(const char *cmd, CommandStats *cs, steady_clock::time_point sent, int timeout_ms) {
+    unsigned char chunk[256];
+    int n;
+    bool broken = false;
 
-    // Once connected, set the baud rate and other serial config (Don't rely on this being correct on the system by default...)
-    speed_t baud = B2400;
+    // Sleep in poll() until bytes arrive and decode as we go.  Once a frame is in progress or
+    // has turned out broken, REPLY_GAP of silence ends it instead of the full timeout: the rest
+    // of a reply follows within milliseconds, and after a lost CR nothing follows at all.
+    steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeout_ms);
+    bool idle = false;
 
-    // Speed settings (in this case, 2400 8N1)
-    struct termios settings;
-    tcgetattr(fd, &settings);
+    while (true) {
+        if (next_reply(cmd, idle, &broken)) {
+            cs->latency.Add(duration_cast<microseconds>(steady_clock::now() - sent).count());
+            lprintf("INVERTER: %s query finished", cmd);
+            return true;
+        }
+        idle = false;
+
+        int remaining = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        bool partial = decoder.Buffered() > 0;
+        if ((broken || partial) && remaining > REPLY_GAP)
+            remaining = REPLY_GAP;
+        if (remaining <= 0) {
+            lprintf("INVERTER: %s command timeout, or couldn't find stop byte", cmd);
+            if (!broken)
+                stats.timeouts++;
+            cs->errors++;
+            return false;
+        }
 
-    cfsetspeed(&settings, baud);      // baud rate
-    settings.c_cflag &= ~PARENB;       // no parity
-    settings.c_cflag &= ~CSTOPB;       // 1 stop bit
-    settings.c_cflag &= ~CSIZE;        // Clear all bits that set the data size
-    settings.c_cflag |= CS8 | CLOCAL;  // 8 bits
+        n = port->Read(chunk, sizeof(chunk), remaining);
+        if (n < 0) {
+            cs->errors++;
+            return false;
+        }
+        if (n == 0 && (partial || broken)) {
+            idle = partial;     // last chance for the pending frame
+            deadline = steady_clock::now();
+        }
+        stats.bytes_read.fetch_add(n, std::memory_order_relaxed);
+        if (capture)
+            capture->Record(unit, CAP_RX, chunk, n);
+        decoder.Feed(chunk, n);
+    }
+}
 
-    settings.c_oflag &= ~OPOST;        // Prevent special interpretation of output bytes (e.g. newline chars)
-    settings.c_lflag &= ~ICANON;
-    settings.c_iflag &= ~(IXON | IXOFF | IXANY); // Turn off s/w flow ctrl
-    settings.c_lflag &= ~ISIG;
-    settings.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
-    settings.c_lflag &= ~ECHO;             // turn off Echo input characters.
-    settings.c_lflag &= ~IEXTEN;           // disable implementation-defined input processing.
-    settings.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL); // Disable any special handling of received bytes
-    tcsetattr(fd, TCSANOW, &settings); // apply the settings
-    tcflush(fd, TCOFLUSH);
+// One command, one reply (strict mode, raw commands)
+bool cInverter::query(const char *cmd, int timeout_ms) {
+    if (!port->Connect())
+        return false;
 
-    // ---------------------------------------------------------------
+    // Drop anything left over in the output queue from a previous command
+    port->FlushOutput();
 
-    // Generating CRC for a command
-    uint16_t crc = cal_crc_half((uint8_t*)cmd, strlen(cmd));
-    n = strlen(cmd);
-    memcpy(&buf, cmd, n);
-    lprintf("INVERTER: Current CRC: %X %X", crc >> 8, crc & 0xff);
+    CommandStats *cs = stats.Command(cmd);
+    steady_clock::time_point sent = steady_clock::now();
+    if (!send(cmd)) {
+        cs->errors++;
+        return false;
+    }
+    return receive(cmd, cs, sent, timeout_ms);
+}
 
-    buf[n++] = crc >> 8;
-    buf[n++] = crc & 0xff;
-    buf[n++] = 0x0d;
+// Pipelined transaction over every due query.  The next command is written the moment the
+// previous reply has passed its checks, and that reply is then handled while the command is
+// still going out, so the line does not sit idle between replies.  A failed reply ends the
+// transaction; the queries not sent yet stay due and start the next one.
+void cInverter::transact(std::vector<cScheduler::Entry*> &due) {
+    if (due.empty() || !port->Connect())
+        return;
+
+    port->FlushOutput();
+
+    CommandStats *cs = stats.Command(due[0]->cmd.c_str());
+    steady_clock::time_point sent = steady_clock::now();
+    if (!send(due[0]->cmd.c_str())) {
+        cs->errors++;
+        return;
+    }
 
-    //send a command
-    write(fd, &buf, n);
-    time(&started);
+    for (size_t k = 0; k < due.size(); k++) {
+        bool ok = receive(due[k]->cmd.c_str(), cs, sent, 2000);
 
-    const int READ_BUFFER_SIZE = 15;
-    bool reading = true;
-    bool timeout = false;
-    do {
-        n = read(fd, (void*)buf+i, READ_BUFFER_SIZE);
-        if (n < 0) {
-            if (time(NULL) - started > 2) {
-                timeout = true;
-                lprintf("INVERTER: %s read timeout", cmd);
-                break;
-            } else {
-                usleep(2000);
-                continue;
-            }
-        } else {
-           for (int j=i; j<i+n; j++) {
-                if (buf[j] == 0x0d){
-                    reading = false;
-                    replysize = j+1;
-                    lprintf("INVERTER: stop byte detected, buffersize might be %d for %s ", replysize, cmd);
-                    break;
-                }
+        bool more = ok && k + 1 < due.size() && !preempted(due[k+1]);
+        if (more) {
+            cs = stats.Command(due[k+1]->cmd.c_str());
+            sent = steady_clock::now();
+            if (!send(due[k+1]->cmd.c_str())) {
+                cs->errors++;
+                more = false;
             }
-
         }
-        usleep(2000);
-
-        i += n;
-    } while (reading);
-    close(fd);
 
-    if (timeout) {
-        lprintf("INVERTER: %s command timeout, or couldn't find stop byte. Byte read (%d bytes). Buffer: %s ", cmd, i, buf);
-        return false;
+        handle(due[k], ok);
+        if (!more)
+            break;
     }
+}
 
-    lprintf("INVERTER: %s reply size (%d bytes)", cmd, replysize);
+// A queued raw command that must not wait for 'next' ends the transaction early
+bool cInverter::preempted(const cScheduler::Entry *next) {
+    std::lock_guard<std::mutex> lock(m);
+    return quit_thread || (!pending.empty() && pending.front()->priority >= next->priority);
+}
 
-    if (buf[0]!='(') {
-        lprintf("INVERTER: %s: incorrect start bytes.  Buffer: %s ", cmd, buf);
-        return false;
+// Publishes the reply in buf and reschedules the query
+void cInverter::handle(cScheduler::Entry *e, bool ok) {
+    if (ok)
+        dispatch(e->cmd, (const char*)buf+1, duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+    sched.Done(e, ok, (const char*)buf+1);
+}
+
+// Puts a reply where it belongs in the snapshot; true if that made a sample
+bool cInverter::dispatch(const std::string &cmd, const char *reply, int64_t now) {
+    const ProtoCommand *pc = ProtoFind(cmd.c_str());
+    std::vector<std::string>::iterator x = std::find(extras.begin(), extras.end(), cmd);
+
+    if (pc && pc->have)
+        return publish(pc->have, reply, now);
+    if (x != extras.end() && strcmp(reply, "NAK"))     // not on this firmware after all
+        publish_extra(x - extras.begin(), reply);
+    else
+        lprintf("INVERTER: %s reply not handled: %s", cmd.c_str(), reply);
+    return false;
+}
+
+// Offline counterpart of send() / receive(): one record of a capture file goes through the
+// decoder into the snapshot the way the live bytes did.  Like on the line, only the first
+// reply to a command counts, and a frame without CR is taken once the next command goes out.
+bool cInverter::Replay(const CaptureRecord &r, int64_t *when) {
+    bool broken = false;
+    bool sample = false;
+    int64_t now = r.time_us / 1000;
+
+    if (r.type == CAP_TX) {
+        // Live, the frame was taken after REPLY_GAP of silence
+        *when = std::min(replay_rx + REPLY_GAP, now);
+        if (!replay_cmd.empty() && next_reply(replay_cmd.c_str(), true, &broken))
+            sample = dispatch(replay_cmd, (const char*)buf+1, *when);
+        decoder.Reset();
+
+        // The command as scheduled: without the CRC and CR, and without the date of QED & co.
+        std::string text((const char*)r.data, r.len > 3 ? r.len - 3 : 0);
+        const ProtoCommand *pc = ProtoFind(text.c_str());
+        replay_cmd = pc && pc->arg ? pc->name : text;
+        stats.Command(replay_cmd.c_str());
+        return sample;
     }
-    if (!(CheckCRC(buf, replysize))) {
-        lprintf("INVERTER: %s: CRC Failed!  Reply size: %d  Buffer: %s ", cmd, replysize, buf);
+
+    // Bytes nobody waits for would have been flushed before the next command
+    if (r.type != CAP_RX || replay_cmd.empty())
         return false;
+    replay_rx = now;
+    stats.bytes_read.fetch_add(r.len, std::memory_order_relaxed);
+    decoder.Feed(r.data, r.len);
+    if (next_reply(replay_cmd.c_str(), false, &broken)) {
+        *when = now;
+        sample = dispatch(replay_cmd, (const char*)buf+1, now);
+        replay_cmd.clear();
     }
-
-    buf[replysize-3] = '\0'; //nullterminating on first CRC byte
-    lprintf("INVERTER: %s: %d bytes read: %s ", cmd, replysize, buf);
-
-    lprintf("INVERTER: %s query finished", cmd);
-    return true;
+    return sample;
 }
 
 void cInverter::poll() {
-    int n,j;
     extern const bool runOnce;
 
     while (true) {
+        if (quit_thread) return;
 
-        // Reading mode
-        if (!ups_qmod_changed) {
-            if (query("QMOD")) {
-                SetMode(buf[1]);
-                ups_qmod_changed = true;
+        // Nothing due yet (or the device is gone and we're backing off) - wait without spinning
+        int wait_ms;
+        cScheduler::Entry *e = sched.Next(&wait_ms);
+        m.lock();
+        bool queued = !pending.empty();
+        m.unlock();
+        if ((!e && !queued) || !port->Connect()) {
+            if (runOnce && !port->IsOpen() && port->Failures() >= (unsigned long)ONE_SHOT_TRIES) {
+                lerror("INVERTER: Unable to open %s, giving up", device.c_str());
+                finished = true;
+                notifier.Notify();
+                return;
             }
+            if (port->MsUntilReconnect() > wait_ms)
+                wait_ms = port->MsUntilReconnect();
+            std::unique_lock<std::mutex> lock(m);
+            wake.wait_for(lock, milliseconds(wait_ms), [this] {
+                return quit_thread || (port->IsOpen() && !pending.empty());
+            });
+            continue;
         }
 
-        // reading status (QPIGS)
-        if (!ups_qpigs_changed) {
-            if (query("QPIGS")) {
-                m.lock();
-                strcpy(status1, (const char*)buf+1);
-                m.unlock();
-                ups_qpigs_changed = true;
-            }
-        }
+        // Raw commands from -r / the control socket, unless a more important query is due
+        if (runPending(e) || !e)
+            continue;
 
-        // Reading QPIRI status
-        if (!ups_qpiri_changed) {
-            if (query("QPIRI")) {
-                m.lock();
-                strcpy(status2, (const char*)buf+1);
-                m.unlock();
-                ups_qpiri_changed = true;
-            }
+        if (pipelined) {
+            sched.Due(batch);
+            transact(batch);
+        } else {
+            handle(e, query(e->cmd.c_str()));
         }
 
-        // Get any device warnings...
-        if (!ups_qpiws_changed) {
-            if (query("QPIWS")) {
-                m.lock();
-                strcpy(warnings, (const char*)buf+1);
-                m.unlock();
-                ups_qpiws_changed = true;
-            }
-        }
-        if (quit_thread) return;
-        sleep(5);
-        // leave after delay for main thread having time to printout data
-        if (runOnce) {
-            ups_leave = true;
-            exit(0);
+        // One pass over every scheduled command is all a run-once needs
+        if (runOnce && sched.AllRan()) {
+            finished = true;
+            notifier.Notify();
+            return;
         }
     }
 }
 
-void cInverter::ExecuteCmd(const string cmd) {
-    // Sending any command raw
-    if (query(cmd.data())) {
-        m.lock();
-        strcpy(status2, (const char*)buf+1);
-        m.unlock();
+// Stores a reply in the snapshot and publishes it.  Once QMOD, QPIRI and QPIGS have all been
+// seen, the consumer is notified - for the first complete set and then for every fresh QPIGS reply.
+// 'now' is the steady clock in ms.
+bool cInverter::publish(int what, const char *reply, int64_t now) {
+    switch (what) {
+        case HAVE_QMOD:
+            if (work.mode && reply[0] != work.mode)
+                linfo("INVERTER: Mode changed from %c to %c", work.mode, reply[0]);
+            work.mode = reply[0];
+            break;
+        case HAVE_QPIGS:
+            if (work.have & HAVE_QPIGS)
+                stats.sample_interval.Add((now - work.qpigs_time) * 1000);
+            snprintf(work.qpigs, sizeof(work.qpigs), "%s", reply);
+            work.qpigs_time = now;
+            break;
+        case HAVE_QPIRI: snprintf(work.qpiri, sizeof(work.qpiri), "%s", reply); break;
+        case HAVE_QPIWS: snprintf(work.qpiws, sizeof(work.qpiws), "%s", reply); break;
+    }
+
+    bool was_complete = (work.have & HAVE_SAMPLE) == HAVE_SAMPLE;
+    work.have |= what;
+    bool sample = (work.have & HAVE_SAMPLE) == HAVE_SAMPLE && (what == HAVE_QPIGS || !was_complete);
+    if (sample)
+        work.version++;
+    shared.Store(work);
+
+    if (sample)
+        notifier.Notify();
+    return sample;
+}
+
+// Extras ride along with the next sample, they do not make one
+void cInverter::publish_extra(int slot, const char *reply) {
+    snprintf(work.ext[slot], sizeof(work.ext[slot]), "%s", reply);
+    work.ext_have |= 1 << slot;
+    shared.Store(work);
+}
+
+// Gives a scheduled registry command without a sample role its snapshot slot
+void cInverter::add_extra(const std::string &cmd) {
+    const ProtoCommand *pc = ProtoFind(cmd.c_str());
+    if (!pc || pc->have || !pc->nfields || std::find(extras.begin(), extras.end(), cmd) != extras.end())
+        return;
+    if (extras.size() == PROTO_MAX_EXTRAS) {
+        lwarn("INVERTER: Only %d extra commands can be polled, ignoring the reply of %s", PROTO_MAX_EXTRAS, cmd.c_str());
+        return;
+    }
+    extras.push_back(cmd);
+}
+
+void cInverter::terminateThread() {
+    m.lock();
+    quit_thread = true;
+    m.unlock();
+    wake.notify_all();
+    if (t1.joinable())
+        t1.join();
+}
+
+// Run-once: each command once, retried right away if it fails.  'cmds' (-q) replaces the
+// schedule; when empty, the scheduled commands are used.
+void cInverter::OneShot(const std::vector<std::string> &cmds) {
+    if (!cmds.empty()) {
+        sched = cScheduler();
+        extras.clear();
+        for (size_t i = 0; i < cmds.size(); i++) {
+            const ProtoCommand *pc = ProtoFind(cmds[i].c_str());
+            if (pc && !(pc->variants & variant))
+                lwarn("INVERTER: %s is not known on this protocol variant, polling it anyway", cmds[i].c_str());
+            sched.Add(cmds[i], 1, 0);
+            add_extra(cmds[i]);
+        }
     }
+    sched.Once(ONE_SHOT_TRIES);
 }
 
-uint16_t cInverter::cal_crc_half(uint8_t *pin, uint8_t len) {
-    uint16_t crc;
-
-    uint8_t da;
-    uint8_t *ptr;
-    uint8_t bCRCHign;
-    uint8_t bCRCLow;
-
-    uint16_t crc_ta[16]= {
-        0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
-        0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef
-    };
-
-    ptr=pin;
-    crc=0;
-
-    while(len--!=0) {
-        da=((uint8_t)(crc>>8))>>4;
-        crc<<=4;
-        crc^=crc_ta[da^(*ptr>>4)];
-        da=((uint8_t)(crc>>8))>>4;
-        crc<<=4;
-        crc^=crc_ta[da^(*ptr&0x0f)];
-        ptr++;
+void cInverter::Schedule(const std::string &cmd, const std::string &spec) {
+    const ProtoCommand *pc = ProtoFind(cmd.c_str());
+    if (!sched.Configure(cmd, spec))
+        return;
+    if (pc && !(pc->variants & variant))
+        lwarn("INVERTER: %s is not known on this protocol variant, polling it anyway", cmd.c_str());
+    add_extra(cmd);
+}
+
+// Runs the first queued raw command, if any and if its priority is not below the due query's
+bool cInverter::runPending(const cScheduler::Entry *due) {
+    m.lock();
+    if (pending.empty() || (due && pending.front()->priority < due->priority)) {
+        m.unlock();
+        return false;
     }
+    RawCmd *rc = pending.front();
+    pending.pop_front();
+    m.unlock();
 
-    bCRCLow = crc;
-    bCRCHign= (uint8_t)(crc>>8);
+    bool ok = query(rc->cmd.c_str());
 
-    if(bCRCLow==0x28||bCRCLow==0x0d||bCRCLow==0x0a)
-        bCRCLow++;
-    if(bCRCHign==0x28||bCRCHign==0x0d||bCRCHign==0x0a)
-        bCRCHign++;
+    m.lock();
+    rc->ok = ok;
+    if (ok)
+        rc->reply = (const char*)buf+1;
+    rc->done = true;
+    m.unlock();
+    cmd_done.notify_all();
+    return true;
+}
 
-    crc = ((uint16_t)bCRCHign)<<8;
-    crc += bCRCLow;
-    return(crc);
+// Queues a raw command for the running poller thread and waits for its reply
+bool cInverter::Submit(const std::string &cmd, std::string &reply, int priority, int timeout_ms) {
+    RawCmd rc;
+    rc.cmd = cmd;
+    rc.priority = priority;
+    rc.ok = false;
+    rc.done = false;
+
+    std::unique_lock<std::mutex> lock(m);
+    if (quit_thread || finished)
+        return false;
+    std::deque<RawCmd*>::iterator pos = pending.begin();
+    while (pos != pending.end() && (*pos)->priority >= priority)
+        pos++;
+    pending.insert(pos, &rc);
+    wake.notify_all();
+
+    if (!cmd_done.wait_for(lock, milliseconds(timeout_ms), [&rc] { return rc.done; })) {
+        // Not picked up in time: withdraw it, unless the poller is already sending it
+        std::deque<RawCmd*>::iterator it = std::find(pending.begin(), pending.end(), &rc);
+        if (it != pending.end()) {
+            pending.erase(it);
+            lprintf("INVERTER: %s was not sent, poller busy or device unavailable", cmd.c_str());
+            return false;
+        }
+        cmd_done.wait(lock, [&rc] { return rc.done; });
+    }
+    reply = rc.reply;
+    return rc.ok;
+}
+
+bool cInverter::ExecuteCmd(const string cmd, std::string &reply) {
+    // Sending any command raw
+    if (!query(cmd.data()))
+        return false;
+    reply = (const char*)buf+1;
+    return true;
 }
 
-bool cInverter::CheckCRC(unsigned char *data, int len) {
-    uint16_t crc = cal_crc_half(data, len-3);
+bool cInverter::CheckCRC(const unsigned char *data, int len) {
+    uint16_t crc = cal_crc(data, len-3);
     return data[len-3]==(crc>>8) && data[len-2]==(crc&0xff);
 }
@@ -4,46 +4,105 @@
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 
+#include <deque>
 #include <string>
+#include <vector>
+#include "capture.h"
+#include "decoder.h"
+#include "protocol.h"
+#include "transport.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "stats.h"
 
 using namespace std;
 
 class cInverter {
-    unsigned char buf[1024]; //internal work buffer
-
-    char warnings[1024];
-    char status1[1024];
-    char status2[1024];
-    char mode;
+    unsigned char buf[cFrameDecoder::FRAME_MAX + 1]; // last reply, NUL terminated at the CRC
+    cFrameDecoder decoder;  // reply bytes on their way to buf
 
     std::string device;
+    cTransport *port;   // serial or hidraw, kept open across queries
+    cCapture *capture;  // records the raw traffic when set
+    std::string replay_cmd;             // Replay(): command whose reply is awaited, empty once in
+    int64_t replay_rx;                  // Replay(): time of the last RX record, ms
+    cScheduler sched;
+    cStats stats;
     std::mutex m;
     std::thread t1;
     std::atomic_bool quit_thread{false};
+    bool pipelined;                     // send the next due query as soon as a reply is in
+    int variant;                        // PV_* firmware variant, see protocol.h
+    std::vector<std::string> extras;    // scheduled extra commands, by snapshot slot
+    std::vector<cScheduler::Entry*> batch;
+
+    // Snapshot handoff: the poller fills 'work' and publishes copies of it through 'shared'.
+    // Readers load 'shared' lock-free and are woken up through 'notifier'.
+    int unit;
+    InverterSnapshot work;
+    cSeqlock<InverterSnapshot> shared;
+    cNotifier &notifier;
+    std::atomic_bool finished{false};   // poller is done, no more samples will come
+    std::condition_variable wake;       // interrupts the poller's idle wait (with m)
+
+    // Raw commands submitted from other threads, interleaved with the scheduled queries:
+    // a queued command goes first unless a due scheduled query has a higher priority
+    struct RawCmd {
+        std::string cmd;
+        int priority;
+        std::string reply;
+        bool ok;
+        bool done;
+    };
+    std::deque<RawCmd*> pending;        // highest priority first, FIFO within a priority (guarded by m)
+    std::condition_variable cmd_done;   // signalled (with m) when a RawCmd completes
 
-    void SetMode(char newmode);
-    bool CheckCRC(unsigned char *buff, int len);
-    bool query(const char *cmd);
-    uint16_t cal_crc_half(uint8_t *pin, uint8_t len);
+    bool publish(int what, const char *reply, int64_t now);
+    bool dispatch(const std::string &cmd, const char *reply, int64_t now);
+    void publish_extra(int slot, const char *reply);
+    void add_extra(const std::string &cmd);
+    bool runPending(const cScheduler::Entry *due);
+    bool preempted(const cScheduler::Entry *next);
+    void handle(cScheduler::Entry *e, bool ok);
+    void transact(std::vector<cScheduler::Entry*> &due);
+    bool send(const char *cmd);
+    bool next_reply(const char *cmd, bool flush, bool *broken);
+    bool receive(const char *cmd, CommandStats *cs, std::chrono::steady_clock::time_point sent, int timeout_ms);
+    bool query(const char *cmd, int timeout_ms = 2000);
 
     public:
-        cInverter(std::string devicename);
+        cInverter(std::string devicename, int unitid, cNotifier &n, int protocol = PV_VM3);
+        ~cInverter();
         void poll();
+        void Schedule(const std::string &cmd, const std::string &spec);
+        void Strict(bool on) { pipelined = !on; }
+        void OneShot(const std::vector<std::string> &cmds);
+        void Capture(cCapture *c) { capture = c; }
+        bool Replay(const CaptureRecord &r, int64_t *when);    // true if it completed a sample at 'when' (ms)
+        // Commands whose replies land in the snapshot's ext[] slots, in slot order
+        const std::vector<std::string> &Extras() const { return extras; }
         void runMultiThread() {
             t1 = std::thread(&cInverter::poll, this);
         }
-        void terminateThread() {
-            quit_thread = true;
-            t1.join();
-        }
-
-        string *GetQpiriStatus();
-        string *GetQpigsStatus();
-        string *GetWarnings();
+        void terminateThread();
+        bool Finished() { return finished; }
+        int Unit() { return unit; }
 
+        void GetSnapshot(InverterSnapshot *out) { shared.Load(out); }
+        static int ModeNumber(char mode);
         int GetMode();
-        void ExecuteCmd(const std::string cmd);
+
+        bool ExecuteCmd(const std::string cmd, std::string &reply);
+        static bool CheckCRC(const unsigned char *buff, int len);  // reply frame incl. CRC and CR
+        static const int REPLY_GAP = 100;       // ms of silence that ends a reply in progress
+        static const int RAW_PRIORITY = 10;     // default: ahead of every scheduled query
+        static const int ONE_SHOT_TRIES = 3;    // per query and for opening the device
+        bool Submit(const std::string &cmd, std::string &reply, int priority = RAW_PRIORITY, int timeout_ms = 10000);
+        const std::string &Device() { return device; }
+        const cStats &Stats() const { return stats; }
+        const cTransport &Port() const { return *port; }
 };
 
 #endif // ___INVERTER_H
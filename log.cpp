@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "log.h"
+
+#define LOG_SLOTS 512           // power of two
+#define LOG_MSG   496
+#define LOG_BATCH (64 * 1024)
+
+int logLevel = LL_WARN;
+
+// Bounded multi-producer queue (Vyukov): a slot's sequence number says whether it is free
+// for the producer at 'pos' (seq == pos) or holds the message for the consumer (seq == pos + 1)
+struct LogSlot {
+    std::atomic<uint64_t> seq;
+    struct timespec ts;
+    int level;
+    char msg[LOG_MSG];
+};
+
+static LogSlot ring[LOG_SLOTS];
+static std::atomic<uint64_t> enqueue_pos(0);
+static uint64_t dequeue_pos = 0;               // writer only
+static std::atomic<unsigned long> dropped(0);
+
+static struct RingInit {
+    RingInit() {
+        for (uint64_t i = 0; i < LOG_SLOTS; i++)
+            ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+} ring_init;
+
+static std::thread writer;
+static std::atomic<bool> quit(false);
+static std::atomic<bool> sleeping(false);
+static int wake_fd = -1;
+
+static std::string log_path;
+static int log_fd = -1;
+static long log_size;
+static long log_max;
+static int log_keep;
+
+static const char level_char[] = { 'E', 'W', 'I', 'D' };
+
+// write() can only fail with EAGAIN when the counter is saturated, i.e. already readable
+static void wake() {
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+void log_write(int level, const char *format, ...) {
+    uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    LogSlot *s;
+
+    while (true) {
+        s = &ring[pos & (LOG_SLOTS - 1)];
+        int64_t dif = (int64_t)(s->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);   // full: never block the caller
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &s->ts);
+    s->level = level;
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(s->msg, sizeof(s->msg), format, ap);
+    va_end(ap);
+    s->seq.store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in run(): either the writer sees this message in its last drain()
+    // before poll(), or we see 'sleeping' and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) && wake_fd != -1)
+        wake();
+}
+
+int log_level(const char *name) {
+    const char *names[] = { "error", "warn", "info", "debug" };
+    for (int i = 0; i < 4; i++)
+        if (!strcmp(name, names[i]))
+            return i;
+    return -1;
+}
+
+static void rotate() {
+    close(log_fd);
+    for (int i = log_keep; i > 0; i--) {
+        std::string from = i > 1 ? log_path + "." + std::to_string(i - 1) : log_path;
+        rename(from.c_str(), (log_path + "." + std::to_string(i)).c_str());
+    }
+    log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (log_keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    log_size = 0;
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+static void flush_batch(const char *batch, size_t len) {
+    if (!len)
+        return;
+    write_all(2, batch, len);
+    if (log_fd != -1) {
+        if (log_max > 0 && log_size + (long)len > log_max)
+            rotate();
+        if (log_fd != -1) {
+            write_all(log_fd, batch, len);
+            log_size += len;
+        }
+    }
+}
+
+// Moves every complete message from the ring to the sinks; false if there was none
+static bool drain() {
+    static char batch[LOG_BATCH];
+    size_t len = 0;
+    bool any = false;
+
+    unsigned long lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost)
+        len += snprintf(batch, sizeof(batch), "LOG: %lu messages dropped, the ring was full\n", lost);
+
+    while (true) {
+        LogSlot *s = &ring[dequeue_pos & (LOG_SLOTS - 1)];
+        if (s->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+            break;
+        any = true;
+
+        if (len + LOG_MSG + 64 > sizeof(batch)) {
+            flush_batch(batch, len);
+            len = 0;
+        }
+        struct tm tm;
+        localtime_r(&s->ts.tv_sec, &tm);
+        len += strftime(batch + len, sizeof(batch) - len, "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(batch + len, sizeof(batch) - len, ".%03ld %c %s\n", s->ts.tv_nsec / 1000000,
+                        level_char[s->level & 3], s->msg);
+
+        s->seq.store(dequeue_pos + LOG_SLOTS, std::memory_order_release);
+        dequeue_pos++;
+    }
+    flush_batch(batch, len);
+    return any;
+}
+
+static void run() {
+    while (!quit.load()) {
+        if (drain())
+            continue;
+        // Nothing queued: announce the sleep, then look once more before blocking (see log_write())
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!drain()) {
+            struct pollfd pfd = { wake_fd, POLLIN, 0 };
+            if (::poll(&pfd, 1, -1) > 0) {
+                uint64_t v;
+                ssize_t n = read(wake_fd, &v, sizeof(v));   // just resets the eventfd
+                (void)n;
+            }
+        }
+        sleeping.store(false);
+    }
+}
+
+void log_start() {
+    if (writer.joinable())
+        return;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    quit = false;
+    writer = std::thread(run);
+    static bool registered = false;
+    if (!registered) {
+        atexit(log_stop);
+        registered = true;
+    }
+}
+
+void log_stop() {
+    if (writer.joinable()) {
+        quit = true;
+        wake();
+        writer.join();
+    }
+    drain();
+}
+
+bool log_open(const char *path, long max_size, int keep) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        lerror("LOG: Unable to open %s (errno=%d %s)", path, errno, strerror(errno));
+        return false;
+    }
+    // From here on only the writer touches the file (log_open() is called before log_start())
+    log_path = path;
+    log_max = max_size;
+    log_keep = keep;
+    log_size = lseek(fd, 0, SEEK_END);
+    log_fd = fd;
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef ___LOG_H
+#define ___LOG_H
+
+// Asynchronous logger.
+// A log call checks the level first - arguments of a disabled level are never evaluated -
+// then formats the message straight into a slot of a lock-free ring buffer, together with a
+// raw timestamp.  A background thread turns the timestamps into dates and writes the
+// messages in batches to stderr and to the log file, which stays open and is rotated by
+// size.  When the ring is full messages are dropped (and counted) rather than blocking the
+// caller.
+
+enum { LL_ERROR, LL_WARN, LL_INFO, LL_DEBUG };
+
+extern int logLevel;            // messages above this level are skipped
+
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define lerror(...)  do { if (logLevel >= LL_ERROR) log_write(LL_ERROR, __VA_ARGS__); } while (0)
+#define lwarn(...)   do { if (logLevel >= LL_WARN)  log_write(LL_WARN,  __VA_ARGS__); } while (0)
+#define linfo(...)   do { if (logLevel >= LL_INFO)  log_write(LL_INFO,  __VA_ARGS__); } while (0)
+#define lprintf(...) do { if (logLevel >= LL_DEBUG) log_write(LL_DEBUG, __VA_ARGS__); } while (0)
+
+int log_level(const char *name);    // "error", "warn", "info", "debug"; -1 if unknown
+
+// Starts the writer thread (messages logged before are kept in the ring); log_stop() flushes
+// everything and is also run at exit
+void log_start();
+void log_stop();
+
+// Also write to 'path', rotated to path.1 .. path.<keep> once it grows past max_size bytes.
+// Must be called before log_start().
+bool log_open(const char *path, long max_size, int keep);
+
+#endif // ___LOG_H
@@ -8,15 +8,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <thread>
-#include <sys/file.h>
 
 #include "main.h"
 #include "tools.h"
 #include "inputparser.h"
+#include "parser.h"
+#include "control.h"
+#include "metrics.h"
+#include "output.h"
+#include "mqtt.h"
+#include "history.h"
+#include "energy.h"
+#include "capture.h"
 
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 
 #include <iostream>
 #include <string>
@@ -27,29 +36,38 @@
 
 bool debugFlag = false;
 bool runOnce = false;
-bool ups_leave = false;
 
-cInverter *ups = NULL;
-
-atomic_bool ups_status_changed(false);
-atomic_bool ups_qmod_changed(false);
-atomic_bool ups_qpiri_changed(false);
-atomic_bool ups_qpigs_changed(false);
-atomic_bool ups_qpiws_changed(false);
-atomic_bool ups_cmd_executed(false);
+vector<cInverter*> units;
+cNotifier notifier;
+cOutput *output = NULL;
+cMqttClient *mqtt = NULL;
+cHistory history;
+vector<cEnergy> energy;
+cDeltaFilter delta;             // change-only publishing, off unless output_delta= is set
+cCapture capture;
 
 
 // ---------------------------------------
 // Global configs read from 'inverter.conf'
 
-string devicename;
-int runinterval;
+string outputformat = "json";  // json, ndjson, csv or binary
+vector<string> devices;         // one 'device=' line per inverter, unit IDs follow file order
+vector<bool> strictdevices;     // device=<path>,strict: one query at a time on that link
 float ampfactor;
 float wattfactor;
-int qpiri = 98;
-int qpiws = 36;
-int qmod = 5;
-int qpigs = 110;
+string protocol = "vm3";        // firmware variant: vm3, mks, pip or max (protocol.h)
+vector<pair<string, string> > pollschedule;    // poll_<cmd>=<period ms>,<priority>[,<max period ms>]
+MqttConfig mqttconfig;          // enabled when mqtt_host is set
+string historyfile;             // sample history, disabled when empty
+int historysize = 100000;       // records, only used when the file is created
+int historysync = 30;           // msync() every N records
+string loglevel;                // error, warn (default), info or debug
+string logfile;                 // log to this file too, off when empty
+int logmaxsize = 1048576;       // rotate the log file beyond this size (bytes)
+int logkeep = 3;                // rotated log files to keep
+string metricslisten;           // [<address>:]<port> of the Prometheus endpoint, off when empty
+string energyfile;              // persisted Wh counters, not persisted when empty
+string capturefile;             // raw TX/RX traffic is appended here, off when empty
 
 // ---------------------------------------
 
@@ -85,22 +103,79 @@ void getSettingsFile(string filename) {
                 size_t delimiter = fileline.find("=");
                 linepart1 = fileline.substr(0, delimiter);
                 linepart2 = fileline.substr(delimiter+1, string::npos - delimiter);
-                if(linepart1 == "device")
-                    devicename = linepart2;
-                else if(linepart1 == "run_interval")
-                    attemptAddSetting(&runinterval, linepart2);
+                if(linepart1 == "device") {
+                    size_t comma = linepart2.find(",");
+                    devices.push_back(linepart2.substr(0, comma));
+                    strictdevices.push_back(comma != string::npos && linepart2.substr(comma+1) == "strict");
+                }
+                else if(linepart1 == "output")
+                    outputformat = linepart2;
+                else if(linepart1 == "output_delta") {
+                    int keyframe = 0;
+                    attemptAddSetting(&keyframe, linepart2);
+                    delta.Keyframe(keyframe);
+                }
+                else if(linepart1 == "deadband") {
+                    float band = 0;
+                    attemptAddSetting(&band, linepart2);
+                    delta.Deadband(band);
+                }
+                else if(linepart1.compare(0, 9, "deadband_") == 0) {
+                    float band = 0;
+                    attemptAddSetting(&band, linepart2);
+                    delta.Deadband(linepart1.substr(9), band);
+                }
                 else if(linepart1 == "amperage_factor")
                     attemptAddSetting(&ampfactor, linepart2);
                 else if(linepart1 == "watt_factor")
                     attemptAddSetting(&wattfactor, linepart2);
-                else if(linepart1 == "qpiri")
-                    attemptAddSetting(&qpiri, linepart2);
-                else if(linepart1 == "qpiws")
-                    attemptAddSetting(&qpiws, linepart2);
-                else if(linepart1 == "qmod")
-                    attemptAddSetting(&qmod, linepart2);
-                else if(linepart1 == "qpigs")
-                    attemptAddSetting(&qpigs, linepart2);
+                else if(linepart1 == "protocol")
+                    protocol = linepart2;
+                else if(linepart1 == "mqtt_host")
+                    mqttconfig.host = linepart2;
+                else if(linepart1 == "mqtt_port")
+                    attemptAddSetting(&mqttconfig.port, linepart2);
+                else if(linepart1 == "mqtt_client_id")
+                    mqttconfig.client_id = linepart2;
+                else if(linepart1 == "mqtt_username")
+                    mqttconfig.username = linepart2;
+                else if(linepart1 == "mqtt_password")
+                    mqttconfig.password = linepart2;
+                else if(linepart1 == "mqtt_topic")
+                    mqttconfig.topic = linepart2;
+                else if(linepart1 == "mqtt_mode")
+                    mqttconfig.per_field = (linepart2 == "field");
+                else if(linepart1 == "mqtt_retain")
+                    mqttconfig.retain = (linepart2 == "1" || linepart2 == "true");
+                else if(linepart1 == "mqtt_keepalive")
+                    attemptAddSetting(&mqttconfig.keepalive, linepart2);
+                else if(linepart1 == "mqtt_queue")
+                    attemptAddSetting(&mqttconfig.queue, linepart2);
+                else if(linepart1 == "log_level")
+                    loglevel = linepart2;
+                else if(linepart1 == "log_file")
+                    logfile = linepart2;
+                else if(linepart1 == "log_max_size")
+                    attemptAddSetting(&logmaxsize, linepart2);
+                else if(linepart1 == "log_keep")
+                    attemptAddSetting(&logkeep, linepart2);
+                else if(linepart1 == "metrics_listen")
+                    metricslisten = linepart2;
+                else if(linepart1 == "energy_file")
+                    energyfile = linepart2;
+                else if(linepart1 == "capture_file")
+                    capturefile = linepart2;
+                else if(linepart1 == "history_file")
+                    historyfile = linepart2;
+                else if(linepart1 == "history_size")
+                    attemptAddSetting(&historysize, linepart2);
+                else if(linepart1 == "history_sync")
+                    attemptAddSetting(&historysync, linepart2);
+                else if(linepart1.compare(0, 5, "poll_") == 0) {
+                    string cmd = linepart1.substr(5);
+                    transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+                    pollschedule.push_back(make_pair(cmd, linepart2));
+                }
                 else
                     continue;
             }
@@ -111,59 +186,174 @@ void getSettingsFile(string filename) {
     }
 }
 
-int main(int argc, char* argv[]) {
+time_t energysaved = 0;
+
+// 'timestamp' is unix time in ms: now, or when a replayed reply was recorded
+void printSample(int unit, const InverterSnapshot &snap, int64_t timestamp) {
+    Sample s;
+
+    s.timestamp = timestamp;
+    s.monotonic = snap.qpigs_time;
+    s.unit = unit;
+    s.mode = cInverter::ModeNumber(snap.mode);
+
+    // Parse and display values.  A one-shot run may have read only some of the replies (-q);
+    // the rest stays zero and is left out of the output.
+    bool complete = (snap.have & HAVE_SAMPLE) == HAVE_SAMPLE;
+    if (!complete)
+        memset(&s.qpigs, 0, sizeof(s) - offsetof(Sample, qpigs));
+    if (((snap.have & HAVE_QPIGS) && !ParseQpigs(snap.qpigs, &s.qpigs)) ||
+        ((snap.have & HAVE_QPIRI) && !ParseQpiri(snap.qpiri, &s.qpiri))) {
+        lwarn("INVERTER: Skipping sample of unit %d with malformed reply", unit);
+        return;
+    }
+    ParseQpiws(snap.qpiws, &s.qpiws);  // not required for a sample, may not have been read yet
+
+    // Extra commands: their latest reply, or -1 everywhere until one has been read
+    const vector<string> &extras = units[unit]->Extras();
+    for (size_t i = 0; i < extras.size(); i++) {
+        ProtoValues &v = s.ext[i];
+        v.count = 0;
+        for (int j = 0; j < PROTO_MAX_FIELDS; j++)
+            v.v[j] = -1;
+        if (snap.ext_have & (1 << i))
+            ProtoParse(ProtoFind(extras[i].c_str()), snap.ext[i], &v, &v.count);
+    }
+
+    // There appears to be a discrepancy in actual DMM measured current vs what the meter is
+    // telling me it's getting, so lets add a variable we can multiply/divide by to adjust if
+    // needed.  This should be set in the config so it can be changed without program recompile.
+    lprintf("INVERTER: ampfactor from config is %.2f", ampfactor);
+    lprintf("INVERTER: wattfactor from config is %.2f", wattfactor);
+
+    s.pv_input_current = s.qpigs.pv_current * ampfactor;
+
+    // It appears on further inspection of the documentation, that the input current is actually
+    // current that is going out to the battery at battery voltage (NOT at PV voltage).  This
+    // would explain the larger discrepancy we saw before.
+
+    s.pv_input_watts = (s.qpigs.scc_voltage * s.pv_input_current) * wattfactor;
+
+    // Watt-hours since the previous sample, and the running totals
+    if (snap.have & HAVE_QPIGS)
+        energy[unit].Update(s);
+    if (!energyfile.empty() && timestamp / 1000 - energysaved >= ENERGY_SAVE_INTERVAL) {
+        cEnergy::Save(energyfile, energy);
+        energysaved = timestamp / 1000;
+    }
+
+    static vector<bool> changed;
+    if (runOnce && !OutputFieldsFrom(snap.have, snap.ext_have, changed)) {
+        output->Emit(s, &changed);
+        if (mqtt)
+            mqtt->PublishSample(s, &changed);
+        if (complete)
+            history.Append(s);
+        return;
+    }
+
+    // The history keeps every sample; outputs only get what changed if output_delta= is set
+    history.Append(s);
+    if (delta.Enabled()) {
+        if (!delta.Filter(s, changed))
+            return;
+        output->Emit(s, &changed);
+        if (mqtt)
+            mqtt->PublishSample(s, &changed);
+        return;
+    }
+
+    // Output is expected to be parsed by another tool...
+    output->Emit(s);
+    if (mqtt)
+        mqtt->PublishSample(s);
+}
+
+// Prints min/max/avg of one history field per bucket (or every point with bucket 0) as CSV
+int printHistory(const string &field, int unit, int seconds, int bucket) {
+    int idx = cHistory::FieldIndex(field);
+    if (idx < 0) {
+        printf("Unknown history field: %s\nAvailable:", field.c_str());
+        for (int i = 0; i < HISTORY_VALUES; i++)
+            printf(" %s", history_fields[i]);
+        printf("\n");
+        return 1;
+    }
+    if (historyfile.empty() || !history.OpenReadOnly(historyfile)) {
+        printf("No history file configured or readable (history_file=)\n");
+        return 1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t to = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + 1;
+    int64_t from = to - (int64_t)seconds * 1000;
+
+    if (bucket <= 0) {
+        vector<HistoryRecord> recs;
+        history.Query(unit, from, to, recs);
+        printf("Timestamp,%s\n", field.c_str());
+        for (size_t i = 0; i < recs.size(); i++)
+            printf("%lld,%.2f\n", (long long)recs[i].timestamp, recs[i].v[idx]);
+    } else {
+        vector<HistoryBucket> buckets;
+        history.Downsample(unit, idx, from, to, (int64_t)bucket * 1000, buckets);
+        printf("Timestamp,Min,Max,Avg,Count\n");
+        for (size_t i = 0; i < buckets.size(); i++)
+            printf("%lld,%.2f,%.2f,%.2f,%d\n", (long long)buckets[i].start, buckets[i].min,
+                   buckets[i].max, buckets[i].avg(), buckets[i].count);
+    }
+    return 0;
+}
+
+// Feeds a capture file through decoder, parser and outputs as fast as possible.  Energy counters
+// start from zero and are not saved, nothing is added to the history.
+int replayCapture(const string &file) {
+    cCaptureReader cap;
+    CaptureRecord r;
+    InverterSnapshot snap;
+    unsigned long records = 0, samples = 0;
+    int64_t when;
+    struct timespec t0, t1;
+
+    if (!cap.Open(file)) {
+        printf("Unable to read capture file %s\n", file.c_str());
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (cap.Next(&r)) {
+        records++;
+        if (r.unit >= (int)units.size())
+            continue;   // recorded with more device= lines than configured now
+        if (units[r.unit]->Replay(r, &when)) {
+            units[r.unit]->GetSnapshot(&snap);
+            printSample(r.unit, snap, r.realtime_ms + when - r.time_us / 1000);
+            samples++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "Replayed %lu records, %lu samples in %.3f s (%.0f records/s, %.0f samples/s)\n",
+            records, samples, secs, secs > 0 ? records / secs : 0, secs > 0 ? samples / secs : 0);
+    for (size_t u = 0; u < units.size(); u++) {
+        const cStats &st = units[u]->Stats();
+        fprintf(stderr, "Unit %zu: %lu bytes read, %lu CRC errors, %lu bad start bytes runs, %lu late frames\n",
+                u, st.bytes_read.load(), st.crc_errors.load(), st.bad_start.load(), st.late_frames.load());
+    }
+    return 0;
+}
 
-    // Reply1
-    float voltage_grid;
-    float freq_grid;
-    float voltage_out;
-    float freq_out;
-    int load_va;
-    int load_watt;
-    int load_percent;
-    int voltage_bus;
-    float voltage_batt;
-    int batt_charge_current;
-    int batt_capacity;
-    int temp_heatsink;
-    float pv_input_current;
-    float pv_input_voltage;
-    float pv_input_watts;
-    float pv_input_watthour;
-    float load_watthour = 0;
-    float scc_voltage;
-    int batt_discharge_current;
-    char device_status[9];
-
-    // Reply2
-    float grid_voltage_rating;
-    float grid_current_rating;
-    float out_voltage_rating;
-    float out_freq_rating;
-    float out_current_rating;
-    int out_va_rating;
-    int out_watt_rating;
-    float batt_rating;
-    float batt_recharge_voltage;
-    float batt_under_voltage;
-    float batt_bulk_voltage;
-    float batt_float_voltage;
-    int batt_type;
-    int max_grid_charge_current;
-    int max_charge_current;
-    int in_voltage_range;
-    int out_source_priority;
-    int charger_source_priority;
-    int machine_type;
-    int topology;
-    int out_mode;
-    float batt_redischarge_voltage;
+int main(int argc, char* argv[]) {
 
     // Get command flag settings from the arguments (if any)
     InputParser cmdArgs(argc, argv);
     const string &rawcmd = cmdArgs.getCmdOption("-r");
-    int replylen = 7;
-    sscanf(cmdArgs.getCmdOption("-l").c_str(), "%d", &replylen);
+    int rawunit = 0;
+    sscanf(cmdArgs.getCmdOption("-u").c_str(), "%d", &rawunit);
+    int rawprio = cInverter::RAW_PRIORITY;
+    sscanf(cmdArgs.getCmdOption("-p").c_str(), "%d", &rawprio);
 
     if(cmdArgs.cmdOptionExists("-h") || cmdArgs.cmdOptionExists("--help")) {
         return print_help();
@@ -174,7 +364,24 @@ int main(int argc, char* argv[]) {
     if(cmdArgs.cmdOptionExists("-1") || cmdArgs.cmdOptionExists("--run-once")) {
         runOnce = true;
     }
-    lprintf("INVERTER: Debug set");
+    // -q QPIGS,QMOD: a one-shot of just these queries
+    vector<string> queries;
+    if (cmdArgs.cmdOptionExists("-q")) {
+        string list = cmdArgs.getCmdOption("-q");
+        transform(list.begin(), list.end(), list.begin(), ::toupper);
+        for (size_t start = 0, comma; start < list.size(); start = comma + 1) {
+            comma = list.find(',', start);
+            if (comma == string::npos)
+                comma = list.size();
+            if (comma > start)
+                queries.push_back(list.substr(start, comma - start));
+        }
+        if (queries.empty()) {
+            printf("No queries given with -q\n");
+            return 1;
+        }
+        runOnce = true;
+    }
     const char *settings;
 
     // Get the rest of the settings from the conf file
@@ -184,124 +391,174 @@ int main(int argc, char* argv[]) {
         settings = "/etc/inverter/inverter.conf";
     }
     getSettingsFile(settings);
-    int fd = open(settings, O_RDWR);
-    while (flock(fd, LOCK_EX)) sleep(1);
-
-    bool ups_status_changed(false);
-    ups = new cInverter(devicename);
+    if (cmdArgs.cmdOptionExists("-o"))
+        outputformat = cmdArgs.getCmdOption("-o");
+
+    if (!loglevel.empty()) {
+        if (log_level(loglevel.c_str()) < 0)
+            printf("Unknown log_level: %s\n", loglevel.c_str());
+        else
+            logLevel = log_level(loglevel.c_str());
+    }
+    if (debugFlag)
+        logLevel = LL_DEBUG;
+    if (!logfile.empty())
+        log_open(logfile.c_str(), logmaxsize, logkeep);
+    log_start();
+    lprintf("INVERTER: Debug set");
 
-    // Logic to send 'raw commands' to the inverter..
-    if (!rawcmd.empty()) {
-        ups->ExecuteCmd(rawcmd);
-        // We're piggybacking off the qpri status response...
-        printf("Reply:  %s\n", ups->GetQpiriStatus()->c_str());
-        exit(0);
-    } else {
-        ups->runMultiThread();
+    // History queries only read the store, they work while a poller is writing it
+    if (cmdArgs.cmdOptionExists("-H")) {
+        int seconds = 86400, bucket = 3600;
+        sscanf(cmdArgs.getCmdOption("-s").c_str(), "%d", &seconds);
+        sscanf(cmdArgs.getCmdOption("-b").c_str(), "%d", &bucket);
+        return printHistory(cmdArgs.getCmdOption("-H"), rawunit, seconds, bucket);
     }
 
-    while (true) {
-        if (ups_status_changed) {
-            int mode = ups->GetMode();
+    output = cOutput::Create(outputformat);
+    if (!output) {
+        printf("Unknown output format: %s\n", outputformat.c_str());
+        return 1;
+    }
 
-            if (mode)
-                lprintf("INVERTER: Mode Currently set to: %d", mode);
+    if (devices.empty()) {
+        printf("No device configured in %s\n", settings);
+        return 1;
+    }
+    int variant = ProtoVariant(protocol.c_str());
+    if (!variant) {
+        printf("Unknown protocol: %s\n", protocol.c_str());
+        return 1;
+    }
+    for (size_t u = 0; u < devices.size(); u++) {
+        cInverter *ups = new cInverter(devices[u], u, notifier, variant);
+        ups->Strict(strictdevices[u]);
+        for (size_t i = 0; i < pollschedule.size(); i++)
+            ups->Schedule(pollschedule[i].first, pollschedule[i].second);
+        if (runOnce)
+            ups->OneShot(queries);
+        units.push_back(ups);
+    }
+    output->TagUnit(units.size() > 1);
+    for (size_t i = 0; i < units[0]->Extras().size(); i++)
+        OutputAddExtra(i, units[0]->Extras()[i].c_str());
+
+    energy.resize(units.size());
+    if (cmdArgs.cmdOptionExists("-R")) {
+        energyfile.clear();
+        return replayCapture(cmdArgs.getCmdOption("-R"));
+    }
+    if (!energyfile.empty())
+        cEnergy::Load(energyfile, energy);
 
-            ups_status_changed = false;
+    // Logic to send 'raw commands' to the inverter..
+    if (!rawcmd.empty()) {
+        if (rawunit < 0 || rawunit >= (int)units.size()) {
+            printf("No such unit: %d\n", rawunit);
+            return 1;
         }
+        // If a poller is already running on this device, hand the command to it; otherwise
+        // open the device ourselves
+        string reply;
+        bool served;
+        bool ok = control_send(devices[rawunit], rawcmd, rawprio, reply, &served);
+        if (!served && !(ok = units[rawunit]->ExecuteCmd(rawcmd, reply)))
+            reply = "no reply from the inverter";
+        if (!ok) {
+            printf("Error:  %s\n", reply.c_str());
+            exit(1);
+        }
+        printf("Reply:  %s\n", reply.c_str());
+        exit(0);
+    }
 
-        if (ups_qmod_changed && ups_qpiri_changed && ups_qpigs_changed) {
-
-            ups_qmod_changed = false;
-            ups_qpiri_changed = false;
-            ups_qpigs_changed = false;
-
-            int mode = ups->GetMode();
-            string *reply1   = ups->GetQpigsStatus();
-            string *reply2   = ups->GetQpiriStatus();
-            string *warnings = ups->GetWarnings();
+    if (!historyfile.empty() && history.Open(historyfile, historysize))
+        history.SyncEvery(historysync);
 
-            if (reply1 && reply2 && warnings) {
+    if (!capturefile.empty() && capture.Open(capturefile))
+        for (size_t u = 0; u < units.size(); u++)
+            units[u]->Capture(&capture);
 
-                // Parse and display values
-                sscanf(reply1->c_str(), "%f %f %f %f %d %d %d %d %f %d %d %d %f %f %f %d %s", &voltage_grid, &freq_grid, &voltage_out, &freq_out, &load_va, &load_watt, &load_percent, &voltage_bus, &voltage_batt, &batt_charge_current, &batt_capacity, &temp_heatsink, &pv_input_current, &pv_input_voltage, &scc_voltage, &batt_discharge_current, &device_status);
-                sscanf(reply2->c_str(), "%f %f %f %f %f %d %d %f %f %f %f %f %d %d %d %d %d %d %d %d %d %f", &grid_voltage_rating, &grid_current_rating, &out_voltage_rating, &out_freq_rating, &out_current_rating, &out_va_rating, &out_watt_rating, &batt_rating, &batt_recharge_voltage, &batt_under_voltage, &batt_bulk_voltage, &batt_float_voltage, &batt_type, &max_grid_charge_current, &max_charge_current, &in_voltage_range, &out_source_priority, &charger_source_priority, &machine_type, &topology, &out_mode, &batt_redischarge_voltage);
+    if (!mqttconfig.host.empty()) {
+        mqtt = new cMqttClient(mqttconfig);
+        mqtt->Start();
+    }
 
-                // There appears to be a discrepancy in actual DMM measured current vs what the meter is
-                // telling me it's getting, so lets add a variable we can multiply/divide by to adjust if
-                // needed.  This should be set in the config so it can be changed without program recompile.
-                if (debugFlag) {
-                    printf("INVERTER: ampfactor from config is %.2f\n", ampfactor);
-                    printf("INVERTER: wattfactor from config is %.2f\n", wattfactor);
+    // Every inverter gets its own poller thread, and a control socket for raw commands
+    cControlServer control;
+    for (size_t u = 0; u < units.size(); u++) {
+        units[u]->runMultiThread();
+        control.Listen(units[u]);
+    }
+    control.Start();
+
+    cMetricsServer metrics;
+    if (!metricslisten.empty() && metrics.Listen(metricslisten, units))
+        metrics.Start();
+
+    // Sleep until a poller publishes a sample.  QMOD and QPIRI are polled far less often than
+    // QPIGS, so once they have been read every fresh QPIGS reply produces a sample using their
+    // latest known values.
+    unsigned long events = 0;
+    vector<unsigned long> seen(units.size(), 0);
+    vector<bool> printed(units.size(), false);
+    InverterSnapshot snap;
+    bool running = true;
+    int status = 0;
+
+    while (running) {
+        events = notifier.Wait(events);
+
+        running = false;
+        for (size_t u = 0; u < units.size(); u++) {
+            // Check 'finished' before loading the snapshot, so a last sample published right
+            // before finishing is never missed
+            bool finished = units[u]->Finished();
+            if (!finished)
+                running = true;
+
+            // A one-shot prints each unit once, from the snapshot its poller finished with
+            if (runOnce) {
+                if (!finished || printed[u])
+                    continue;
+                printed[u] = true;
+                units[u]->GetSnapshot(&snap);
+                if (!snap.have && !snap.ext_have) {
+                    status = 1;
+                    continue;
                 }
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                printSample(u, snap, (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+                continue;
+            }
 
-                pv_input_current = pv_input_current * ampfactor;
-
-                // It appears on further inspection of the documentation, that the input current is actually
-                // current that is going out to the battery at battery voltage (NOT at PV voltage).  This
-                // would explain the larger discrepancy we saw before.
-
-                pv_input_watts = (scc_voltage * pv_input_current) * wattfactor;
-
-                // Calculate watt-hours generated per run interval period (given as program argument)
-                pv_input_watthour = pv_input_watts / (3600 / runinterval);
-                load_watthour = (float)load_watt / (3600 / runinterval);
-
-                // Print as JSON (output is expected to be parsed by another tool...)
-                printf("{\n");
-
-                printf("  \"Inverter_mode\":%d,\n", mode);
-                printf("  \"AC_grid_voltage\":%.1f,\n", voltage_grid);
-                printf("  \"AC_grid_frequency\":%.1f,\n", freq_grid);
-                printf("  \"AC_out_voltage\":%.1f,\n", voltage_out);
-                printf("  \"AC_out_frequency\":%.1f,\n", freq_out);
-                printf("  \"PV_in_voltage\":%.1f,\n", pv_input_voltage);
-                printf("  \"PV_in_current\":%.1f,\n", pv_input_current);
-                printf("  \"PV_in_watts\":%.1f,\n", pv_input_watts);
-                printf("  \"PV_in_watthour\":%.4f,\n", pv_input_watthour);
-                printf("  \"SCC_voltage\":%.4f,\n", scc_voltage);
-                printf("  \"Load_pct\":%d,\n", load_percent);
-                printf("  \"Load_watt\":%d,\n", load_watt);
-                printf("  \"Load_watthour\":%.4f,\n", load_watthour);
-                printf("  \"Load_va\":%d,\n", load_va);
-                printf("  \"Bus_voltage\":%d,\n", voltage_bus);
-                printf("  \"Heatsink_temperature\":%d,\n", temp_heatsink);
-                printf("  \"Battery_capacity\":%d,\n", batt_capacity);
-                printf("  \"Battery_voltage\":%.2f,\n", voltage_batt);
-                printf("  \"Battery_charge_current\":%d,\n", batt_charge_current);
-                printf("  \"Battery_discharge_current\":%d,\n", batt_discharge_current);
-                printf("  \"Load_status_on\":%c,\n", device_status[3]);
-                printf("  \"SCC_charge_on\":%c,\n", device_status[6]);
-                printf("  \"AC_charge_on\":%c,\n", device_status[7]);
-                printf("  \"Battery_recharge_voltage\":%.1f,\n", batt_recharge_voltage);
-                printf("  \"Battery_under_voltage\":%.1f,\n", batt_under_voltage);
-                printf("  \"Battery_bulk_voltage\":%.1f,\n", batt_bulk_voltage);
-                printf("  \"Battery_float_voltage\":%.1f,\n", batt_float_voltage);
-                printf("  \"Max_grid_charge_current\":%d,\n", max_grid_charge_current);
-                printf("  \"Max_charge_current\":%d,\n", max_charge_current);
-                printf("  \"Out_source_priority\":%d,\n", out_source_priority);
-                printf("  \"Charger_source_priority\":%d,\n", charger_source_priority);
-                printf("  \"Battery_redischarge_voltage\":%.1f,\n", batt_redischarge_voltage);
-                printf("  \"Warnings\":\"%s\"\n", warnings->c_str());
-                printf("}\n");
-
-                // Delete reply string so we can update with new data when polled again...
-                delete reply1;
-                delete reply2;
+            units[u]->GetSnapshot(&snap);
+            if (snap.version != seen[u]) {
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                seen[u] = snap.version;
+                printSample(u, snap, (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
             }
-        } else if (ups_leave) {
-            ups->terminateThread();
-            // Do once and exit instead of loop endlessly
-            lprintf("INVERTER: All queries complete, exiting loop.");
-            exit(0);
         }
-
-        sleep(1);
     }
 
-    if (ups) {
-        ups->terminateThread();
-        delete ups;
+    // Run-once finished (or the poller was stopped)
+    lprintf("INVERTER: All queries complete, exiting loop.");
+    control.Stop();
+    metrics.Stop();
+    for (size_t u = 0; u < units.size(); u++) {
+        units[u]->terminateThread();
+        delete units[u];
     }
-    return 0;
+    if (mqtt) {
+        mqtt->Stop();       // flushes whatever is still queued
+        delete mqtt;
+    }
+    history.Close();
+    capture.Close();
+    if (!energyfile.empty())
+        cEnergy::Save(energyfile, energy);
+    delete output;
+    return status;
 }
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "stats.h"
+#include "tools.h"
+
+cMetricsServer::cMetricsServer() : fd(-1) {
+    if (pipe2(stop_pipe, O_CLOEXEC) == -1)
+        stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+cMetricsServer::~cMetricsServer() {
+    Stop();
+    if (fd != -1)
+        close(fd);
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+}
+
+bool cMetricsServer::Listen(const std::string &spec, const std::vector<cInverter*> &inverters) {
+    std::string host = "127.0.0.1";
+    std::string port = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        host = spec.substr(0, colon);
+        port = spec.substr(colon + 1);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+        lerror("METRICS: Bad listen address %s", spec.c_str());
+        return false;
+    }
+
+    int one = 1;
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    if (fd != -1)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd == -1 || bind(fd, res->ai_addr, res->ai_addrlen) == -1 || listen(fd, 8) == -1) {
+        lerror("METRICS: Unable to listen on %s (errno=%d %s)", spec.c_str(), errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+        freeaddrinfo(res);
+        return false;
+    }
+    freeaddrinfo(res);
+    units = inverters;
+    return true;
+}
+
+void cMetricsServer::Stop() {
+    if (!t1.joinable())
+        return;
+    if (write(stop_pipe[1], "x", 1) != 1)
+        lerror("METRICS: Unable to wake server thread");
+    t1.join();
+}
+
+void cMetricsServer::serve() {
+    struct pollfd pfds[2] = { { fd, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+
+    while (true) {
+        if (::poll(pfds, 2, -1) == -1 && errno != EINTR)
+            return;
+        if (pfds[1].revents)
+            return;
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1)
+            continue;
+        handle(client);
+        close(client);
+    }
+}
+
+// Whatever the request is, the answer is the metrics page
+void cMetricsServer::handle(int client) {
+    struct timeval tv = { 2, 0 };
+    char req[2048];
+    int len = 0;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while (len < (int)sizeof(req) - 1) {
+        int n = recv(client, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            return;
+        len += n;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    std::string body, resp;
+    stats_format(units, body);
+    char head[256];
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+    resp = head;
+    resp += body;
+
+    const char *p = resp.data();
+    size_t left = resp.size();
+    while (left > 0) {
+        int n = send(client, p, left, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        p += n;
+        left -= n;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef ___METRICS_H
+#define ___METRICS_H
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "inverter.h"
+
+// Prometheus scrape endpoint: a minimal HTTP server answering every request with the
+// counters of all units (see stats.h) in the text exposition format.
+// Enabled with metrics_listen=[<address>:]<port> in inverter.conf; the address defaults to
+// 127.0.0.1.  From a shell:  curl http://127.0.0.1:9105/metrics
+
+class cMetricsServer {
+    int fd;
+    std::vector<cInverter*> units;
+    int stop_pipe[2];
+    std::thread t1;
+
+    void serve();
+    void handle(int client);
+
+    public:
+        cMetricsServer();
+        ~cMetricsServer();
+
+        bool Listen(const std::string &spec, const std::vector<cInverter*> &inverters);
+        void Start() { t1 = std::thread(&cMetricsServer::serve, this); }
+        void Stop();
+};
+
+#endif // ___METRICS_H
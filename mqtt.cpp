@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <chrono>
+#include "mqtt.h"
+#include "tools.h"
+
+using namespace std::chrono;
+
+#define MQTT_CONNECT    0x10
+#define MQTT_CONNACK    0x20
+#define MQTT_PUBLISH    0x30
+#define MQTT_PINGREQ    0xc0
+#define MQTT_PINGRESP   0xd0
+#define MQTT_DISCONNECT 0xe0
+
+#define MQTT_BATCH      (64 * 1024)     // max bytes flushed with one write()
+
+// Fixed header: packet type + "remaining length" varint
+static void put_header(std::string &out, uint8_t type, size_t len) {
+    out.push_back(type);
+    do {
+        uint8_t b = len % 128;
+        len /= 128;
+        out.push_back(len ? b | 0x80 : b);
+    } while (len);
+}
+
+static void put_string(std::string &out, const char *s, size_t len) {
+    out.push_back(len >> 8);
+    out.push_back(len & 0xff);
+    out.append(s, len);
+}
+
+cMqttClient::cMqttClient(const MqttConfig &config) : cfg(config) {
+    json = cOutput::Create("ndjson");
+    json->TagUnit(true);
+    ring.resize(cfg.queue > 0 ? cfg.queue : 1);
+    head = tail = 0;
+    dropped = 0;
+    sock = -1;
+    quit = false;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+cMqttClient::~cMqttClient() {
+    Stop();
+    disconnect_broker();
+    close(wake_fd);
+    delete json;
+}
+
+void cMqttClient::Stop() {
+    if (!t1.joinable())
+        return;
+    m.lock();
+    quit = true;
+    m.unlock();
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        lerror("MQTT: Unable to wake publisher thread");
+    t1.join();
+}
+
+// Encodes a QoS 0 PUBLISH into the next ring slot, dropping the oldest packet when full
+void cMqttClient::queue_publish(const std::string &topic, const char *payload, int len) {
+    m.lock();
+    if (head - tail == ring.size()) {
+        tail++;
+        if (!(dropped++ % 100))
+            lwarn("MQTT: Queue full, dropped %lu packets so far", dropped);
+    }
+    std::string &pkt = ring[head % ring.size()];
+    pkt.clear();
+    put_header(pkt, MQTT_PUBLISH | (cfg.retain ? 0x01 : 0), 2 + topic.size() + len);
+    put_string(pkt, topic.data(), topic.size());
+    pkt.append(payload, len);
+    head++;
+    m.unlock();
+}
+
+void cMqttClient::PublishSample(const Sample &s, const std::vector<bool> *changed) {
+    char topic[256];
+    char value[16384];
+
+    if (cfg.per_field) {
+        for (int i = 0; i < OutputFieldCount(); i++) {
+            if (changed && !(*changed)[i])
+                continue;
+            snprintf(topic, sizeof(topic), "%s/%d/%s", cfg.topic.c_str(), s.unit, OutputFieldName(i));
+            int n = OutputFieldValue(s, i, value, sizeof(value));
+            if (n >= 0 && n < (int)sizeof(value))
+                queue_publish(topic, value, n);
+        }
+    } else {
+        snprintf(topic, sizeof(topic), "%s/%d", cfg.topic.c_str(), s.unit);
+        int n = json->Format(s, value, sizeof(value), changed);
+        if (n > 0)
+            queue_publish(topic, value, n - 1);     // without the trailing newline
+    }
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        lerror("MQTT: Unable to wake publisher thread");
+}
+
+bool cMqttClient::send_all(const char *data, int len) {
+    while (len > 0) {
+        int n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { sock, POLLOUT, 0 };
+                if (::poll(&pfd, 1, cfg.keepalive > 0 ? cfg.keepalive * 1000 : 5000) <= 0)
+                    return false;
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool cMqttClient::connect_broker() {
+    struct addrinfo hints, *res, *ai;
+    char port[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", cfg.port);
+    if (getaddrinfo(cfg.host.c_str(), port, &hints, &res) != 0) {
+        lerror("MQTT: Unable to resolve %s", cfg.host.c_str());
+        return false;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock == -1)
+            continue;
+        struct timeval tv = { 5, 0 };       // bounds connect() too
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock == -1) {
+        lerror("MQTT: Unable to connect to %s:%d (errno=%d %s)", cfg.host.c_str(), cfg.port, errno, strerror(errno));
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // CONNECT: protocol "MQTT" level 4, clean session
+    std::string body, pkt;
+    uint8_t flags = 0x02;
+    if (!cfg.username.empty())
+        flags |= 0x80;
+    if (!cfg.password.empty())
+        flags |= 0x40;
+    put_string(body, "MQTT", 4);
+    body.push_back(4);
+    body.push_back(flags);
+    body.push_back(cfg.keepalive >> 8);
+    body.push_back(cfg.keepalive & 0xff);
+    put_string(body, cfg.client_id.data(), cfg.client_id.size());
+    if (!cfg.username.empty())
+        put_string(body, cfg.username.data(), cfg.username.size());
+    if (!cfg.password.empty())
+        put_string(body, cfg.password.data(), cfg.password.size());
+    put_header(pkt, MQTT_CONNECT, body.size());
+    pkt += body;
+
+    unsigned char ack[4];
+    int n = 0;
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    if (!send_all(pkt.data(), pkt.size())) {
+        disconnect_broker();
+        return false;
+    }
+    while (n < 4 && ::poll(&pfd, 1, 5000) > 0) {
+        int r = recv(sock, ack + n, 4 - n, 0);
+        if (r <= 0)
+            break;
+        n += r;
+    }
+    if (n < 4 || ack[0] != MQTT_CONNACK || ack[3] != 0) {
+        lerror("MQTT: Broker refused connection (return code %d)", n == 4 ? ack[3] : -1);
+        disconnect_broker();
+        return false;
+    }
+
+    linfo("MQTT: Connected to %s:%d", cfg.host.c_str(), cfg.port);
+    return true;
+}
+
+void cMqttClient::disconnect_broker() {
+    if (sock == -1)
+        return;
+    const char bye[2] = { (char)MQTT_DISCONNECT, 0 };
+    send(sock, bye, 2, MSG_NOSIGNAL);
+    close(sock);
+    sock = -1;
+}
+
+// Sends every queued packet, batched into as few write()s as possible; 'sent' tells whether
+// anything went out
+bool cMqttClient::flush(bool *sent) {
+    std::string batch;
+
+    *sent = false;
+    while (true) {
+        m.lock();
+        uint64_t last = tail;
+        batch.clear();
+        while (last < head && batch.size() < MQTT_BATCH)
+            batch += ring[last++ % ring.size()];
+        m.unlock();
+
+        if (batch.empty())
+            return true;
+        if (!send_all(batch.data(), batch.size()))
+            return false;
+        *sent = true;
+
+        // Only now drop them from the ring (unless the ring already overwrote them)
+        m.lock();
+        if (tail < last)
+            tail = last;
+        m.unlock();
+    }
+}
+
+void cMqttClient::drain_wake() {
+    uint64_t v;
+    if (read(wake_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        lerror("MQTT: eventfd read failed");
+}
+
+void cMqttClient::run() {
+    int backoff = 0;
+    bool sent;
+    bool ping_pending = false;      // PINGREQ out, PINGRESP not seen yet
+    steady_clock::time_point last_tx = steady_clock::now();
+    steady_clock::time_point ping_sent = last_tx;
+    steady_clock::time_point retry_at = last_tx;
+
+    while (true) {
+        m.lock();
+        bool stop = quit;
+        m.unlock();
+        if (stop) {
+            if (sock != -1)
+                flush(&sent);
+            return;
+        }
+
+        struct pollfd pfd[2] = { { wake_fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+
+        if (sock == -1) {
+            // Keep queueing meanwhile; retry with a growing delay (1 s .. 60 s)
+            int wait = duration_cast<milliseconds>(retry_at - steady_clock::now()).count();
+            if (wait > 0) {
+                ::poll(pfd, 1, wait);
+                drain_wake();
+                continue;
+            }
+            if (!connect_broker()) {
+                backoff = backoff ? (backoff * 2 > 60000 ? 60000 : backoff * 2) : 1000;
+                retry_at = steady_clock::now() + milliseconds(backoff);
+                continue;
+            }
+            backoff = 0;
+            ping_pending = false;
+            last_tx = steady_clock::now();
+        }
+
+        if (!flush(&sent)) {
+            lwarn("MQTT: Connection lost (errno=%d %s)", errno, strerror(errno));
+            disconnect_broker();
+            continue;
+        }
+        if (sent)
+            last_tx = steady_clock::now();
+
+        // Idle: wait for new packets, broker traffic or the keepalive deadline.  Keepalive 0
+        // switches the mechanism off (MQTT 3.1.1, 3.1.2.10): no deadline, no pings.
+        int keepalive_ms = cfg.keepalive > 0 ? cfg.keepalive * 1000 : 0;
+        ::poll(pfd, 2, keepalive_ms ? keepalive_ms / 2 : -1);
+        if (pfd[0].revents & POLLIN)
+            drain_wake();
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char in[256];
+            int r = recv(sock, in, sizeof(in), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN)) {
+                lwarn("MQTT: Broker closed the connection");
+                disconnect_broker();
+                continue;
+            }
+            ping_pending = false;       // PINGRESP (nothing else is expected for QoS 0)
+        }
+        if (!keepalive_ms)
+            continue;
+
+        // QoS 0 PUBLISH gets no answer, so only a PINGREQ tells whether the broker is alive.
+        // It goes out once we have sent nothing for half the keepalive.
+        steady_clock::time_point now = steady_clock::now();
+        if (ping_pending && duration_cast<milliseconds>(now - ping_sent).count() > keepalive_ms) {
+            lwarn("MQTT: No answer from broker, reconnecting");
+            disconnect_broker();
+        } else if (!ping_pending && duration_cast<milliseconds>(now - last_tx).count() >= keepalive_ms / 2) {
+            const char ping[2] = { (char)MQTT_PINGREQ, 0 };
+            if (!send_all(ping, 2)) {
+                disconnect_broker();
+                continue;
+            }
+            ping_pending = true;
+            ping_sent = last_tx = now;
+        }
+    }
+}
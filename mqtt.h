@@ -0,0 +1,70 @@
+#ifndef ___MQTT_H
+#define ___MQTT_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "output.h"
+
+// Minimal MQTT 3.1.1 publisher (QoS 0 only).
+// Samples are encoded into PUBLISH packets straight away and queued in a bounded ring; a
+// background thread keeps one connection to the broker and flushes everything queued with
+// a single write().  While the broker is unreachable the ring keeps the newest packets and
+// drops the oldest ones.
+//
+// Topics:  <topic>/<unit>           one NDJSON document per sample   (mqtt_mode=snapshot)
+//          <topic>/<unit>/<field>   one message per field            (mqtt_mode=field)
+// With output_delta= only the changed fields are in a sample.
+
+struct MqttConfig {
+    std::string host;
+    int port;
+    std::string client_id;
+    std::string username;
+    std::string password;
+    std::string topic;          // topic prefix
+    bool per_field;
+    bool retain;
+    int keepalive;              // seconds, 0 = no keepalive pings
+    int queue;                  // ring size in packets
+
+    MqttConfig() : port(1883), client_id("inverter_poller"), topic("inverter"),
+                   per_field(false), retain(false), keepalive(60), queue(1024) {}
+};
+
+class cMqttClient {
+    MqttConfig cfg;
+    cOutput *json;              // NDJSON formatter for snapshot mode
+
+    // Ring of encoded PUBLISH packets; slots are reused so steady state does not allocate
+    std::mutex m;
+    std::vector<std::string> ring;
+    uint64_t head;              // next packet number to be queued
+    uint64_t tail;              // oldest packet number still queued
+    unsigned long dropped;
+
+    int sock;
+    int wake_fd;                // eventfd: new packets or stop
+    bool quit;
+    std::thread t1;
+
+    void run();
+    bool connect_broker();
+    void disconnect_broker();
+    bool flush(bool *sent);
+    void drain_wake();
+    bool send_all(const char *data, int len);
+    void queue_publish(const std::string &topic, const char *payload, int len);
+
+    public:
+        cMqttClient(const MqttConfig &config);
+        ~cMqttClient();
+
+        void Start() { t1 = std::thread(&cMqttClient::run, this); }
+        void Stop();
+        void PublishSample(const Sample &s, const std::vector<bool> *changed = NULL);
+};
+
+#endif // ___MQTT_H
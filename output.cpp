@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+#include "output.h"
+#include "snapshot.h"
+#include "tools.h"
+
+enum { F_INT, F_FLOAT, F_DOUBLE, F_BIT, F_STR, F_NUMBER };
+
+struct OutField {
+    const char *name;
+    int type;
+    int decimals;       // F_FLOAT, F_DOUBLE (F_NUMBER: float printed as short as possible)
+    size_t offset;      // into Sample
+    int bit;            // F_BIT: index into the '0'/'1' flag string
+};
+
+#define S(f)     offsetof(Sample, f)
+
+// Everything we publish of the classic sample, in output order.  Reply fields name their
+// registry command and field (protocol.cpp), which give their type and place in the Sample;
+// the rest are Sample members.  The extra commands' fields are appended at startup.
+struct BaseField {
+    const char *name;
+    const char *cmd;        // registry command, NULL for a Sample member
+    const char *field;      // registry field of 'cmd'
+    int type;               // F_*, Sample members only
+    int decimals;
+    size_t offset;          // Sample members only
+    int bit;                // F_BIT: index into the '0'/'1' flag string
+};
+
+static const BaseField base_fields[] = {
+    { "Inverter_mode",               "QMOD",  "mode",                     0,        0, 0,                    0 },
+    { "AC_grid_voltage",             "QPIGS", "grid_voltage",             0,        1, 0,                    0 },
+    { "AC_grid_frequency",           "QPIGS", "grid_freq",                0,        1, 0,                    0 },
+    { "AC_out_voltage",              "QPIGS", "out_voltage",              0,        1, 0,                    0 },
+    { "AC_out_frequency",            "QPIGS", "out_freq",                 0,        1, 0,                    0 },
+    { "PV_in_voltage",               "QPIGS", "pv_voltage",               0,        1, 0,                    0 },
+    { "PV_in_current",               NULL,    NULL,                       F_FLOAT,  1, S(pv_input_current),  0 },
+    { "PV_in_watts",                 NULL,    NULL,                       F_FLOAT,  1, S(pv_input_watts),    0 },
+    { "PV_in_watthour",              NULL,    NULL,                       F_FLOAT,  4, S(pv_input_watthour), 0 },
+    { "SCC_voltage",                 "QPIGS", "scc_voltage",              0,        4, 0,                    0 },
+    { "Load_pct",                    "QPIGS", "load_percent",             0,        0, 0,                    0 },
+    { "Load_watt",                   "QPIGS", "load_watt",                0,        0, 0,                    0 },
+    { "Load_watthour",               NULL,    NULL,                       F_FLOAT,  4, S(load_watthour),     0 },
+    { "Load_va",                     "QPIGS", "load_va",                  0,        0, 0,                    0 },
+    { "Bus_voltage",                 "QPIGS", "bus_voltage",              0,        0, 0,                    0 },
+    { "Heatsink_temperature",        "QPIGS", "heatsink_temp",            0,        0, 0,                    0 },
+    { "Battery_capacity",            "QPIGS", "batt_capacity",            0,        0, 0,                    0 },
+    { "Battery_voltage",             "QPIGS", "batt_voltage",             0,        2, 0,                    0 },
+    { "Battery_charge_current",      "QPIGS", "batt_charge_current",      0,        0, 0,                    0 },
+    { "Battery_discharge_current",   "QPIGS", "batt_discharge_current",   0,        0, 0,                    0 },
+    { "Load_status_on",              "QPIGS", "device_status",            0,        0, 0,                    3 },
+    { "SCC_charge_on",               "QPIGS", "device_status",            0,        0, 0,                    6 },
+    { "AC_charge_on",                "QPIGS", "device_status",            0,        0, 0,                    7 },
+    { "Battery_recharge_voltage",    "QPIRI", "batt_recharge_voltage",    0,        1, 0,                    0 },
+    { "Battery_under_voltage",       "QPIRI", "batt_under_voltage",       0,        1, 0,                    0 },
+    { "Battery_bulk_voltage",        "QPIRI", "batt_bulk_voltage",        0,        1, 0,                    0 },
+    { "Battery_float_voltage",       "QPIRI", "batt_float_voltage",       0,        1, 0,                    0 },
+    { "Max_grid_charge_current",     "QPIRI", "max_grid_charge_current",  0,        0, 0,                    0 },
+    { "Max_charge_current",          "QPIRI", "max_charge_current",       0,        0, 0,                    0 },
+    { "Out_source_priority",         "QPIRI", "out_source_priority",      0,        0, 0,                    0 },
+    { "Charger_source_priority",     "QPIRI", "charger_source_priority",  0,        0, 0,                    0 },
+    { "Battery_redischarge_voltage", "QPIRI", "batt_redischarge_voltage", 0,        1, 0,                    0 },
+    { "Warnings",                    NULL,    NULL,                       F_STR,    0, S(qpiws.bits),        0 },
+    { "PV_total_watthour",           NULL,    NULL,                       F_DOUBLE, 1, S(total.pv),          0 },
+    { "Load_total_watthour",         NULL,    NULL,                       F_DOUBLE, 1, S(total.load),        0 },
+    { "Battery_in_total_watthour",   NULL,    NULL,                       F_DOUBLE, 1, S(total.batt_in),     0 },
+    { "Battery_out_total_watthour",  NULL,    NULL,                       F_DOUBLE, 1, S(total.batt_out),    0 },
+    { "PV_today_watthour",           NULL,    NULL,                       F_DOUBLE, 1, S(today.pv),          0 },
+    { "Load_today_watthour",         NULL,    NULL,                       F_DOUBLE, 1, S(today.load),        0 },
+    { "Battery_in_today_watthour",   NULL,    NULL,                       F_DOUBLE, 1, S(today.batt_in),     0 },
+    { "Battery_out_today_watthour",  NULL,    NULL,                       F_DOUBLE, 1, S(today.batt_out),    0 },
+};
+
+// Where a classic command's reply struct lives in the Sample
+static size_t reply_offset(const ProtoCommand *pc) {
+    switch (pc->have) {
+        case HAVE_QMOD:  return S(mode);
+        case HAVE_QPIRI: return S(qpiri);
+        default:         return S(qpigs);
+    }
+}
+
+static std::vector<OutField> base_output() {
+    std::vector<OutField> out;
+
+    for (size_t i = 0; i < sizeof(base_fields) / sizeof(base_fields[0]); i++) {
+        const BaseField &b = base_fields[i];
+        OutField f = { b.name, b.type, b.decimals, b.offset, b.bit };
+        if (b.cmd) {
+            const ProtoCommand *pc = ProtoFind(b.cmd);
+            const ProtoField *pf = NULL;
+            for (int j = 0; pc && j < pc->nfields && !pf; j++)
+                if (!strcmp(pc->fields[j].name, b.field))
+                    pf = &pc->fields[j];
+            if (!pf) {
+                // Runs before main(), the logger is not up yet
+                fprintf(stderr, "OUTPUT: %s: no field %s.%s in the protocol registry\n", b.name, b.cmd, b.field);
+                continue;
+            }
+            f.type = pf->type == PF_FLOAT ? F_FLOAT : pf->type == PF_FLAGS ? F_BIT : F_INT;
+            f.offset = reply_offset(pc) + pf->offset;
+        }
+        out.push_back(f);
+    }
+    return out;
+}
+
+static std::vector<OutField> fields = base_output();
+static std::deque<std::string> extra_names;    // owns the names of the appended fields
+
+#define NFIELDS (int)fields.size()
+#define BINARY_MAGIC 0x53564e49     // "INVS"
+#define DELTA_MAGIC  0x44564e49     // "INVD": record with a field presence bitmap
+#define BINARY_STR   40             // fixed width of string fields in binary records
+
+static inline const void *field_ptr(const Sample &s, const OutField &f) {
+    return (const char*)&s + f.offset;
+}
+
+static int field_int(const Sample &s, const OutField &f) {
+    if (f.type == F_BIT)
+        return ((const char*)field_ptr(s, f))[f.bit] == '1';
+    return *(const int*)field_ptr(s, f);
+}
+
+static double field_num(const Sample &s, const OutField &f) {
+    switch (f.type) {
+        case F_FLOAT:
+        case F_NUMBER: return *(const float*)field_ptr(s, f);
+        case F_DOUBLE: return *(const double*)field_ptr(s, f);
+        default:       return field_int(s, f);
+    }
+}
+
+static inline bool wanted(const std::vector<bool> *changed, int i) {
+    return !changed || (*changed)[i];
+}
+
+// Appends a field value as text; strings are quoted when 'quote' is set
+static int put_value(char *p, int len, const Sample &s, const OutField &f, bool quote) {
+    switch (f.type) {
+        case F_FLOAT:  return snprintf(p, len, "%.*f", f.decimals, *(const float*)field_ptr(s, f));
+        case F_DOUBLE: return snprintf(p, len, "%.*f", f.decimals, *(const double*)field_ptr(s, f));
+        case F_NUMBER: return snprintf(p, len, "%.7g", *(const float*)field_ptr(s, f));
+        case F_STR:    return snprintf(p, len, quote ? "\"%s\"" : "%s", (const char*)field_ptr(s, f));
+        default:       return snprintf(p, len, "%d", field_int(s, f));
+    }
+}
+
+// Keeps track of the remaining space while formatting into a fixed buffer
+struct cursor {
+    char *p;
+    int left;
+    bool overflow;
+
+    cursor(char *buf, int len) : p(buf), left(len), overflow(false) {}
+    void advance(int n) {
+        if (n < 0 || n >= left) {
+            overflow = true;
+            n = left > 0 ? left - 1 : 0;
+        }
+        p += n;
+        left -= n;
+    }
+};
+
+void OutputAddExtra(int slot, const char *cmd) {
+    const ProtoCommand *pc = ProtoFind(cmd);
+
+    for (int i = 0; pc && i < pc->nfields; i++) {
+        const ProtoField &pf = pc->fields[i];
+        if (pf.type == PF_SKIP)
+            continue;
+        extra_names.push_back(std::string(cmd) + "_" + pf.name);
+        OutField f = { extra_names.back().c_str(), F_NUMBER, 0,
+                       offsetof(Sample, ext) + slot * sizeof(ProtoValues) + pf.offset, 0 };
+        fields.push_back(f);
+    }
+}
+
+int OutputFieldCount() {
+    return NFIELDS;
+}
+
+const char *OutputFieldName(int i) {
+    return fields[i].name;
+}
+
+int OutputFieldValue(const Sample &s, int i, char *out, int len) {
+    return put_value(out, len, s, fields[i], false);
+}
+
+bool OutputFieldsFrom(int have, int ext_have, std::vector<bool> &avail) {
+    bool all = true;
+
+    avail.assign(NFIELDS, false);
+    for (int i = 0; i < NFIELDS; i++) {
+        size_t off = fields[i].offset;
+        bool ok;
+        if (off >= S(ext))
+            ok = ext_have & (1 << ((off - S(ext)) / sizeof(ProtoValues)));
+        else if (off == S(mode))
+            ok = have & HAVE_QMOD;
+        else if (off >= S(qpiri) && off < S(qpiri) + sizeof(QpiriReply))
+            ok = have & HAVE_QPIRI;
+        else if (off >= S(qpiws) && off < S(qpiws) + sizeof(QpiwsReply))
+            ok = have & HAVE_QPIWS;
+        else
+            ok = have & HAVE_QPIGS;     // live data and everything derived from it
+        avail[i] = ok;
+        all = all && ok;
+    }
+    return all;
+}
+
+class cJsonOutput : public cOutput {
+    bool pretty;
+
+    int format(const Sample &s, const std::vector<bool> *changed, char *out, int len) {
+        cursor c(out, len);
+        const char *indent = pretty ? "  " : "";
+        const char *sep = pretty ? ",\n" : ",";
+        const char *lead = "";
+
+        c.advance(snprintf(c.p, c.left, pretty ? "{\n" : "{"));
+        if (!pretty) {
+            c.advance(snprintf(c.p, c.left, "\"Timestamp\":%lld", (long long)s.timestamp));
+            lead = sep;
+        }
+        if (tag_unit) {
+            c.advance(snprintf(c.p, c.left, "%s%s\"Unit\":%d", lead, indent, s.unit));
+            lead = sep;
+        }
+        for (int i = 0; i < NFIELDS; i++) {
+            if (!wanted(changed, i))
+                continue;
+            c.advance(snprintf(c.p, c.left, "%s%s\"%s\":", lead, indent, fields[i].name));
+            c.advance(put_value(c.p, c.left, s, fields[i], true));
+            lead = sep;
+        }
+        c.advance(snprintf(c.p, c.left, pretty ? "\n}\n" : "}\n"));
+        return c.overflow ? -1 : c.p - out;
+    }
+
+    public:
+        cJsonOutput(bool multiline) : pretty(multiline) {}
+};
+
+class cCsvOutput : public cOutput {
+    bool header_done;
+
+    int format(const Sample &s, const std::vector<bool> *changed, char *out, int len) {
+        cursor c(out, len);
+
+        if (!header_done) {
+            c.advance(snprintf(c.p, c.left, "Timestamp%s", tag_unit ? ",Unit" : ""));
+            for (int i = 0; i < NFIELDS; i++)
+                c.advance(snprintf(c.p, c.left, ",%s", fields[i].name));
+            c.advance(snprintf(c.p, c.left, "\n"));
+            header_done = true;
+        }
+        c.advance(snprintf(c.p, c.left, "%lld", (long long)s.timestamp));
+        if (tag_unit)
+            c.advance(snprintf(c.p, c.left, ",%d", s.unit));
+        for (int i = 0; i < NFIELDS; i++) {
+            c.advance(snprintf(c.p, c.left, ","));
+            if (wanted(changed, i))     // unchanged fields are left empty
+                c.advance(put_value(c.p, c.left, s, fields[i], false));
+        }
+        c.advance(snprintf(c.p, c.left, "\n"));
+        return c.overflow ? -1 : c.p - out;
+    }
+
+    public:
+        cCsvOutput() : header_done(false) {}
+};
+
+// Record: uint32 magic, uint16 record size, uint16 field count, int64 timestamp (ms),
+// int32 unit, then every field in output order as int32 / float32 / float64 / char[40].
+// Change-only records ("INVD") have a bitmap of the fields present (bit i of byte i / 8)
+// after the unit, and only those fields follow.
+class cBinaryOutput : public cOutput {
+    int format(const Sample &s, const std::vector<bool> *changed, char *out, int len) {
+        char *p = out;
+        uint32_t magic = changed ? DELTA_MAGIC : BINARY_MAGIC;
+        uint16_t count = NFIELDS;
+        int32_t unit = s.unit;
+        int bytes = changed ? (NFIELDS + 7) / 8 : 0;
+
+        if (len < 20 + bytes)
+            return -1;
+        memcpy(p, &magic, 4);       p += 4;
+        p += 2;                     // size, filled in below
+        memcpy(p, &count, 2);       p += 2;
+        memcpy(p, &s.timestamp, 8); p += 8;
+        memcpy(p, &unit, 4);        p += 4;
+
+        if (changed) {
+            memset(p, 0, bytes);
+            for (int i = 0; i < NFIELDS; i++)
+                if ((*changed)[i])
+                    p[i / 8] |= 1 << (i % 8);
+            p += bytes;
+        }
+
+        for (int i = 0; i < NFIELDS; i++) {
+            const OutField &f = fields[i];
+            if (!wanted(changed, i))
+                continue;
+            int size = f.type == F_STR ? BINARY_STR : f.type == F_DOUBLE ? 8 : 4;
+            if (p - out + size > len || p - out + size > UINT16_MAX)
+                return -1;
+            if (f.type == F_STR) {
+                memset(p, 0, BINARY_STR);
+                strncpy(p, (const char*)field_ptr(s, f), BINARY_STR);
+                p += BINARY_STR;
+            } else if (f.type == F_FLOAT || f.type == F_NUMBER) {
+                memcpy(p, field_ptr(s, f), 4);
+                p += 4;
+            } else if (f.type == F_DOUBLE) {
+                memcpy(p, field_ptr(s, f), 8);
+                p += 8;
+            } else {
+                int32_t v = field_int(s, f);
+                memcpy(p, &v, 4);
+                p += 4;
+            }
+        }
+
+        uint16_t size = p - out;
+        memcpy(out + 4, &size, 2);
+        return size;
+    }
+};
+
+cOutput *cOutput::Create(const std::string &format) {
+    if (format == "json")
+        return new cJsonOutput(true);
+    if (format == "ndjson")
+        return new cJsonOutput(false);
+    if (format == "csv")
+        return new cCsvOutput();
+    if (format == "binary")
+        return new cBinaryOutput();
+    return NULL;
+}
+
+bool cOutput::Emit(const Sample &s, const std::vector<bool> *changed) {
+    int n = format(s, changed, buf, sizeof(buf));
+    if (n < 0) {
+        lerror("OUTPUT: Sample of unit %d does not fit the output buffer", s.unit);
+        return false;
+    }
+
+    const char *p = buf;
+    while (n > 0) {
+        int w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            lerror("OUTPUT: write failed (errno=%d %s)", errno, strerror(errno));
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+void cDeltaFilter::resolve() {
+    bands.assign(NFIELDS, deadband);
+    for (size_t k = 0; k < configured.size(); k++) {
+        int i = 0;
+        while (i < NFIELDS && strcasecmp(fields[i].name, configured[k].first.c_str()))
+            i++;
+        if (i == NFIELDS)
+            lwarn("OUTPUT: Deadband for unknown field %s ignored", configured[k].first.c_str());
+        else
+            bands[i] = configured[k].second;
+    }
+    for (int i = 0; i < NFIELDS; i++)
+        if (fields[i].type == F_BIT || fields[i].type == F_STR)
+            bands[i] = 0;
+}
+
+bool cDeltaFilter::Filter(const Sample &s, std::vector<bool> &changed) {
+    if ((int)bands.size() != NFIELDS)
+        resolve();
+    if (s.unit >= (int)units.size())
+        units.resize(s.unit + 1);
+
+    UnitState &u = units[s.unit];
+    bool key = u.samples == 0 || (int)u.last.size() != NFIELDS;
+    u.samples = (u.samples + 1) % keyframe;
+    if (key) {
+        u.last.resize(NFIELDS);
+        u.last_str.resize(NFIELDS);
+    }
+
+    bool any = false;
+    changed.assign(NFIELDS, false);
+    for (int i = 0; i < NFIELDS; i++) {
+        const OutField &f = fields[i];
+        if (f.type == F_STR) {
+            const char *v = (const char*)field_ptr(s, f);
+            if (!key && u.last_str[i] == v)
+                continue;
+            u.last_str[i] = v;
+        } else {
+            double v = field_num(s, f);
+            if (!key && fabs(v - u.last[i]) <= bands[i])
+                continue;
+            u.last[i] = v;
+        }
+        changed[i] = true;
+        any = true;
+    }
+    return any;
+}
@@ -0,0 +1,116 @@
+#ifndef ___OUTPUT_H
+#define ___OUTPUT_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "parser.h"
+#include "protocol.h"
+
+// Energy counters, Wh
+struct EnergyCounters {
+    double pv;
+    double load;
+    double batt_in;             // charging
+    double batt_out;            // discharging
+};
+
+// One processed sample, as handed to the output stage
+struct Sample {
+    int64_t timestamp;          // unix time, ms
+    int64_t monotonic;          // steady clock, ms, when QPIGS was read
+    int unit;
+    int mode;
+    QpigsReply qpigs;
+    QpiriReply qpiri;
+    QpiwsReply qpiws;
+
+    // Derived values (amperage/watt factors applied)
+    float pv_input_current;
+    float pv_input_watts;
+    float pv_input_watthour;    // energy since the previous sample
+    float load_watthour;
+    EnergyCounters total;       // since the counters were started, persisted
+    EnergyCounters today;       // since local midnight
+
+    ProtoValues ext[PROTO_MAX_EXTRAS];  // extra commands, in the slots given to OutputAddExtra()
+};
+
+// Output stage: every sample is serialized into one pre-sized buffer and written to the
+// output fd with a single write(), so a reader on a pipe never sees a partial record.
+//
+//   json    the classic multi-line JSON object
+//   ndjson  one compact JSON object per line
+//   csv     header line once, then one line per sample
+//   binary  fixed size little endian records, see README.md for the layout
+//
+// 'changed' (from cDeltaFilter) restricts a record to the marked fields; NULL means all.
+
+class cOutput {
+    protected:
+        int fd;
+        bool tag_unit;          // include the unit ID (several inverters configured)
+        char buf[16384];        // room for the fixed fields and every extra command
+
+        virtual int format(const Sample &s, const std::vector<bool> *changed, char *out, int len) = 0;
+
+    public:
+        cOutput() : fd(1), tag_unit(false) {}
+        virtual ~cOutput() {}
+
+        static cOutput *Create(const std::string &format);
+
+        void TagUnit(bool tag) { tag_unit = tag; }
+        int Format(const Sample &s, char *out, int len, const std::vector<bool> *changed = NULL) {
+            return format(s, changed, out, len);
+        }
+        bool Emit(const Sample &s, const std::vector<bool> *changed = NULL);
+};
+
+// Publishes the fields of extra command 'cmd' from Sample::ext[slot] as <cmd>_<field>, after
+// the fixed fields.  Call once per extra at startup, before the first sample.
+void OutputAddExtra(int slot, const char *cmd);
+
+// Field table access, for sinks that publish fields one by one
+int OutputFieldCount();
+const char *OutputFieldName(int i);
+int OutputFieldValue(const Sample &s, int i, char *out, int len);
+
+// Marks the fields whose source reply is in 'have' (HAVE_* bits) and 'ext_have' (extra slots);
+// false if any is missing
+bool OutputFieldsFrom(int have, int ext_have, std::vector<bool> &avail);
+
+// Change-only publishing (output_delta=<N>): a field is only published when it moved beyond
+// its deadband since the value last published for that unit; strings and flags on any change.
+// Every N-th sample of a unit (and its first) is a keyframe carrying all fields.
+class cDeltaFilter {
+    struct UnitState {
+        std::vector<double> last;
+        std::vector<std::string> last_str;
+        int samples;            // since the last keyframe
+
+        UnitState() : samples(0) {}
+    };
+
+    int keyframe;               // 0 = off
+    double deadband;            // default for fields without their own
+    std::vector<std::pair<std::string, double> > configured;
+    std::vector<double> bands;  // per field, resolved on the first sample
+    std::vector<UnitState> units;
+
+    void resolve();
+
+    public:
+        cDeltaFilter() : keyframe(0), deadband(0) {}
+
+        void Keyframe(int n) { keyframe = n; }
+        void Deadband(double band) { deadband = band; }
+        void Deadband(const std::string &field, double band) { configured.push_back(std::make_pair(field, band)); }
+        bool Enabled() const { return keyframe > 0; }
+
+        // Marks the fields of 's' to publish; false if there is nothing to publish
+        bool Filter(const Sample &s, std::vector<bool> &changed);
+};
+
+#endif // ___OUTPUT_H
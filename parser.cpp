@@ -0,0 +1,182 @@
+#include <charconv>
+#include <string.h>
+#include "parser.h"
+#include "protocol.h"
+#include "tools.h"
+
+// Walks the space separated fields of a reply without copying it
+class cFieldReader {
+    const char *cmd;
+    const char *p;
+    const char *end;
+    const char *tok;
+    const char *tok_end;
+    int n;
+    bool ok;
+
+    bool next() {
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end) {
+            // Running out of fields is only an error for mandatory ones, checked by the caller
+            tok = tok_end = p;
+            return false;
+        }
+        tok = p;
+        while (p < end && *p != ' ')
+            p++;
+        tok_end = p;
+        n++;
+        return true;
+    }
+
+    bool bad(const char *name) {
+        lwarn("PARSER: %s field %d (%s) malformed: '%.*s'", cmd, n, name, (int)(tok_end - tok), tok);
+        ok = false;
+        return false;
+    }
+
+    public:
+        cFieldReader(const char *command, const char *reply) {
+            cmd = command;
+            p = reply;
+            end = reply + strlen(reply);
+            tok = tok_end = p;
+            n = 0;
+            ok = true;
+        }
+
+        bool Int(int &v, const char *name) {
+            v = -1;
+            if (!next())
+                return false;
+            std::from_chars_result r = std::from_chars(tok, tok_end, v);
+            if (r.ec != std::errc() || r.ptr != tok_end)
+                return bad(name);
+            return true;
+        }
+
+        bool Float(float &v, const char *name) {
+            v = -1;
+            if (!next())
+                return false;
+            std::from_chars_result r = std::from_chars(tok, tok_end, v);
+            if (r.ec != std::errc() || r.ptr != tok_end)
+                return bad(name);
+            return true;
+        }
+
+        // Fixed width string of '0'/'1' flags
+        bool Flags(char *v, int len, const char *name) {
+            v[0] = 0;
+            if (!next())
+                return false;
+            if (tok_end - tok != len)
+                return bad(name);
+            for (const char *c = tok; c < tok_end; c++)
+                if (*c != '0' && *c != '1')
+                    return bad(name);
+            memcpy(v, tok, len);
+            v[len] = 0;
+            return true;
+        }
+
+        // '0'/'1' flags of any width, as a number (extras)
+        bool Bits(float &v, const char *name) {
+            v = -1;
+            if (!next())
+                return false;
+            if (tok_end - tok > 24)
+                return bad(name);
+            unsigned bits = 0;
+            for (const char *c = tok; c < tok_end; c++) {
+                if (*c != '0' && *c != '1')
+                    return bad(name);
+                bits = bits << 1 | (*c == '1');
+            }
+            v = bits;
+            return true;
+        }
+
+        // Single mode letter, as the mode number (extras)
+        bool Mode(float &v, const char *name) {
+            v = -1;
+            if (!next())
+                return false;
+            if (tok_end - tok != 1)
+                return bad(name);
+            v = ProtoModeNumber(*tok);
+            return true;
+        }
+
+        bool Skip() {
+            return next();
+        }
+
+        int Count() { return n; }
+
+        // All fields parsed and the count is within what known firmware sends
+        bool Check(int min, int max) {
+            while (next())
+                ;
+            if (ok && (n < min || n > max)) {
+                lwarn("PARSER: %s has %d fields, expected %d..%d", cmd, n, min, max);
+                ok = false;
+            }
+            return ok;
+        }
+};
+
+bool ProtoParse(const ProtoCommand *pc, const char *reply, void *out, int *count) {
+    cFieldReader r(pc->name, reply);
+
+    for (int i = 0; i < pc->nfields; i++) {
+        const ProtoField &f = pc->fields[i];
+        void *v = (char*)out + f.offset;
+        switch (f.type) {
+            case PF_INT:   r.Int(*(int*)v, f.name); break;
+            case PF_FLOAT:
+                if (r.Float(*(float*)v, f.name))
+                    *(float*)v *= f.scale;
+                break;
+            case PF_FLAGS: r.Flags((char*)v, f.width, f.name); break;
+            case PF_BITS:  r.Bits(*(float*)v, f.name); break;
+            case PF_MODE:  r.Mode(*(float*)v, f.name); break;
+            default:       r.Skip(); break;
+        }
+    }
+
+    bool ok = r.Check(pc->min_fields, pc->max_fields);
+    if (count)
+        *count = r.Count();
+    return ok;
+}
+
+bool ParseQpigs(const char *reply, QpigsReply *out) {
+    static const ProtoCommand *pc = ProtoFind("QPIGS");
+    return ProtoParse(pc, reply, out, &out->fields);
+}
+
+bool ParseQpiri(const char *reply, QpiriReply *out) {
+    static const ProtoCommand *pc = ProtoFind("QPIRI");
+    return ProtoParse(pc, reply, out, &out->fields);
+}
+
+bool ParseQpiws(const char *reply, QpiwsReply *out) {
+    int n = 0;
+
+    out->any = false;
+    for (const char *c = reply; *c && *c != ' '; c++, n++) {
+        if (n == QPIWS_MAX_BITS || (*c != '0' && *c != '1')) {
+            lwarn("PARSER: QPIWS malformed at bit %d: '%s'", n, reply);
+            out->bits[0] = 0;
+            out->count = 0;
+            return false;
+        }
+        out->bits[n] = *c;
+        out->any |= *c == '1';
+    }
+    out->bits[n] = 0;
+    out->count = n;
+    return n > 0;
+}
@@ -0,0 +1,96 @@
+#ifndef ___PARSER_H
+#define ___PARSER_H
+
+// Typed decoding of the QPIGS / QPIRI / QPIWS replies.
+// Replies are tokenized in place (no copies, no allocation) and every field is converted with
+// std::from_chars, so a truncated or garbled reply is reported instead of leaving stale values.
+// The field layouts come from the protocol registry (protocol.h).  Different firmware sends a
+// different number of trailing fields; anything within the registry's field count range is
+// accepted, missing optional fields are set to -1.
+
+#define QPIWS_MAX_BITS   40
+
+struct QpigsReply {
+    float grid_voltage;
+    float grid_freq;
+    float out_voltage;
+    float out_freq;
+    int load_va;
+    int load_watt;
+    int load_percent;
+    int bus_voltage;
+    float batt_voltage;
+    int batt_charge_current;
+    int batt_capacity;
+    int heatsink_temp;
+    float pv_current;
+    float pv_voltage;
+    float scc_voltage;
+    int batt_discharge_current;
+    char device_status[9];      // b7..b0 as sent, NUL terminated
+
+    // Optional, newer firmware only
+    int batt_voltage_offset;
+    int eeprom_version;
+    int pv_charging_power;
+    char device_status2[4];
+
+    int fields;                 // number of fields present in the reply
+
+    // Decoded device_status bits
+    int load_on() const        { return device_status[3] == '1'; }
+    int scc_charge_on() const  { return device_status[6] == '1'; }
+    int ac_charge_on() const   { return device_status[7] == '1'; }
+};
+
+struct QpiriReply {
+    float grid_voltage_rating;
+    float grid_current_rating;
+    float out_voltage_rating;
+    float out_freq_rating;
+    float out_current_rating;
+    int out_va_rating;
+    int out_watt_rating;
+    float batt_rating;
+    float batt_recharge_voltage;
+    float batt_under_voltage;
+    float batt_bulk_voltage;
+    float batt_float_voltage;
+    int batt_type;
+    int max_grid_charge_current;
+    int max_charge_current;
+    int in_voltage_range;
+    int out_source_priority;
+    int charger_source_priority;
+    int parallel_max_num;           // field 19: the old sscanf format skipped it (README, QPIRI)
+    int machine_type;
+    int topology;
+    int out_mode;
+
+    // Optional, depending on firmware
+    float batt_redischarge_voltage;
+    int pv_ok_condition;
+    int pv_power_balance;
+    int max_cv_charging_time;
+    int operation_logic;
+    int max_discharge_current;
+
+    int fields;
+};
+
+struct QpiwsReply {
+    char bits[QPIWS_MAX_BITS + 1];  // warning/fault flags as sent, NUL terminated
+    int count;
+    bool any;                       // at least one flag set
+};
+
+struct ProtoCommand;
+
+// Any registry command with a field table; 'out' is its reply struct (ProtoValues for extras)
+bool ProtoParse(const ProtoCommand *pc, const char *reply, void *out, int *count);
+
+bool ParseQpigs(const char *reply, QpigsReply *out);
+bool ParseQpiri(const char *reply, QpiriReply *out);
+bool ParseQpiws(const char *reply, QpiwsReply *out);
+
+#endif // ___PARSER_H
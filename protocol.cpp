@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "protocol.h"
+#include "parser.h"
+#include "snapshot.h"
+
+#define PIGS(f)   offsetof(QpigsReply, f)
+#define PIRI(f)   offsetof(QpiriReply, f)
+#define V(i)      (offsetof(ProtoValues, v) + (i) * sizeof(float))
+#define FIELDS(t) t, (int)(sizeof(t) / sizeof(t[0]))
+
+static const ProtoField qpigs_fields[] = {
+    { "grid_voltage",           PF_FLOAT, 0, 1, PIGS(grid_voltage) },
+    { "grid_freq",              PF_FLOAT, 0, 1, PIGS(grid_freq) },
+    { "out_voltage",            PF_FLOAT, 0, 1, PIGS(out_voltage) },
+    { "out_freq",               PF_FLOAT, 0, 1, PIGS(out_freq) },
+    { "load_va",                PF_INT,   0, 1, PIGS(load_va) },
+    { "load_watt",              PF_INT,   0, 1, PIGS(load_watt) },
+    { "load_percent",           PF_INT,   0, 1, PIGS(load_percent) },
+    { "bus_voltage",            PF_INT,   0, 1, PIGS(bus_voltage) },
+    { "batt_voltage",           PF_FLOAT, 0, 1, PIGS(batt_voltage) },
+    { "batt_charge_current",    PF_INT,   0, 1, PIGS(batt_charge_current) },
+    { "batt_capacity",          PF_INT,   0, 1, PIGS(batt_capacity) },
+    { "heatsink_temp",          PF_INT,   0, 1, PIGS(heatsink_temp) },
+    { "pv_current",             PF_FLOAT, 0, 1, PIGS(pv_current) },
+    { "pv_voltage",             PF_FLOAT, 0, 1, PIGS(pv_voltage) },
+    { "scc_voltage",            PF_FLOAT, 0, 1, PIGS(scc_voltage) },
+    { "batt_discharge_current", PF_INT,   0, 1, PIGS(batt_discharge_current) },
+    { "device_status",          PF_FLAGS, 8, 1, PIGS(device_status) },
+    { "batt_voltage_offset",    PF_INT,   0, 1, PIGS(batt_voltage_offset) },
+    { "eeprom_version",         PF_INT,   0, 1, PIGS(eeprom_version) },
+    { "pv_charging_power",      PF_INT,   0, 1, PIGS(pv_charging_power) },
+    { "device_status2",         PF_FLAGS, 3, 1, PIGS(device_status2) },
+};
+
+static const ProtoField qpiri_fields[] = {
+    { "grid_voltage_rating",      PF_FLOAT, 0, 1, PIRI(grid_voltage_rating) },
+    { "grid_current_rating",      PF_FLOAT, 0, 1, PIRI(grid_current_rating) },
+    { "out_voltage_rating",       PF_FLOAT, 0, 1, PIRI(out_voltage_rating) },
+    { "out_freq_rating",          PF_FLOAT, 0, 1, PIRI(out_freq_rating) },
+    { "out_current_rating",       PF_FLOAT, 0, 1, PIRI(out_current_rating) },
+    { "out_va_rating",            PF_INT,   0, 1, PIRI(out_va_rating) },
+    { "out_watt_rating",          PF_INT,   0, 1, PIRI(out_watt_rating) },
+    { "batt_rating",              PF_FLOAT, 0, 1, PIRI(batt_rating) },
+    { "batt_recharge_voltage",    PF_FLOAT, 0, 1, PIRI(batt_recharge_voltage) },
+    { "batt_under_voltage",       PF_FLOAT, 0, 1, PIRI(batt_under_voltage) },
+    { "batt_bulk_voltage",        PF_FLOAT, 0, 1, PIRI(batt_bulk_voltage) },
+    { "batt_float_voltage",       PF_FLOAT, 0, 1, PIRI(batt_float_voltage) },
+    { "batt_type",                PF_INT,   0, 1, PIRI(batt_type) },
+    { "max_grid_charge_current",  PF_INT,   0, 1, PIRI(max_grid_charge_current) },
+    { "max_charge_current",       PF_INT,   0, 1, PIRI(max_charge_current) },
+    { "in_voltage_range",         PF_INT,   0, 1, PIRI(in_voltage_range) },
+    { "out_source_priority",      PF_INT,   0, 1, PIRI(out_source_priority) },
+    { "charger_source_priority",  PF_INT,   0, 1, PIRI(charger_source_priority) },
+    { "parallel_max_num",         PF_INT,   0, 1, PIRI(parallel_max_num) },
+    { "machine_type",             PF_INT,   0, 1, PIRI(machine_type) },
+    { "topology",                 PF_INT,   0, 1, PIRI(topology) },
+    { "out_mode",                 PF_INT,   0, 1, PIRI(out_mode) },
+    { "batt_redischarge_voltage", PF_FLOAT, 0, 1, PIRI(batt_redischarge_voltage) },
+    { "pv_ok_condition",          PF_INT,   0, 1, PIRI(pv_ok_condition) },
+    { "pv_power_balance",         PF_INT,   0, 1, PIRI(pv_power_balance) },
+    { "max_cv_charging_time",     PF_INT,   0, 1, PIRI(max_cv_charging_time) },
+    { "operation_logic",          PF_INT,   0, 1, PIRI(operation_logic) },
+    { "max_discharge_current",    PF_INT,   0, 1, PIRI(max_discharge_current) },
+};
+
+// The mode letter; the typed sample keeps its number in Sample::mode (see output.cpp)
+static const ProtoField qmod_fields[] = {
+    { "mode", PF_MODE, 0, 1, 0 },
+};
+
+// Second PV input of the MAX models
+static const ProtoField qpigs2_fields[] = {
+    { "PV2_in_current",  PF_FLOAT, 0, 1, V(0) },
+    { "PV2_in_voltage",  PF_FLOAT, 0, 1, V(1) },
+    { "PV2_in_watts",    PF_FLOAT, 0, 1, V(2) },
+};
+
+// One unit of a parallel stack, as seen by the unit we are connected to
+static const ProtoField qpgs_fields[] = {
+    { "Parallel_present",          PF_FLOAT, 0, 1, V(0) },
+    { "Serial_number",             PF_SKIP,  0, 1, 0 },
+    { "Inverter_mode",             PF_MODE,  0, 1, V(1) },
+    { "Fault_code",                PF_FLOAT, 0, 1, V(2) },
+    { "AC_grid_voltage",           PF_FLOAT, 0, 1, V(3) },
+    { "AC_grid_frequency",         PF_FLOAT, 0, 1, V(4) },
+    { "AC_out_voltage",            PF_FLOAT, 0, 1, V(5) },
+    { "AC_out_frequency",          PF_FLOAT, 0, 1, V(6) },
+    { "Load_va",                   PF_FLOAT, 0, 1, V(7) },
+    { "Load_watt",                 PF_FLOAT, 0, 1, V(8) },
+    { "Load_pct",                  PF_FLOAT, 0, 1, V(9) },
+    { "Battery_voltage",           PF_FLOAT, 0, 1, V(10) },
+    { "Battery_charge_current",    PF_FLOAT, 0, 1, V(11) },
+    { "Battery_capacity",          PF_FLOAT, 0, 1, V(12) },
+    { "PV_in_voltage",             PF_FLOAT, 0, 1, V(13) },
+    { "Total_charge_current",      PF_FLOAT, 0, 1, V(14) },
+    { "Total_load_va",             PF_FLOAT, 0, 1, V(15) },
+    { "Total_load_watt",           PF_FLOAT, 0, 1, V(16) },
+    { "Total_load_pct",            PF_FLOAT, 0, 1, V(17) },
+    { "Status",                    PF_BITS,  0, 1, V(18) },
+    { "Out_mode",                  PF_FLOAT, 0, 1, V(19) },
+    { "Charger_source_priority",   PF_FLOAT, 0, 1, V(20) },
+    { "Max_charge_current",        PF_FLOAT, 0, 1, V(21) },
+    { "Max_charge_range",          PF_FLOAT, 0, 1, V(22) },
+    { "Max_grid_charge_current",   PF_FLOAT, 0, 1, V(23) },
+    { "PV_in_current",             PF_FLOAT, 0, 1, V(24) },
+    { "Battery_discharge_current", PF_FLOAT, 0, 1, V(25) },
+};
+
+static const ProtoField energy_fields[] = {
+    { "PV_watthour", PF_FLOAT, 0, 1, V(0) },
+};
+
+static const ProtoCommand commands[] = {
+    // name     arg       variants       len      fields   charset        fields                   have        default schedule
+    { "QPIGS",  NULL,     PV_ALL,        60, 160, 17, 21,  NULL,          FIELDS(qpigs_fields),    HAVE_QPIGS, 2000, 3, 0 },
+    { "QMOD",   NULL,     PV_ALL,         1,   1,  1,  1,  "PSLBFHD",     FIELDS(qmod_fields),     HAVE_QMOD,  5000, 2, 0 },
+    { "QPIWS",  NULL,     PV_ALL,        32,  40,  1,  1,  "01",          NULL, 0,                 HAVE_QPIWS, 10000, 1, 60000 },
+    { "QPIRI",  NULL,     PV_ALL,        60, 160, 22, 28,  NULL,          FIELDS(qpiri_fields),    HAVE_QPIRI, 60000, 0, 600000 },
+    { "QPIGS2", NULL,     PV_MAX,         8,  40,  3,  3,  NULL,          FIELDS(qpigs2_fields),   0,          2000, 3, 0 },
+    { "QPGS#",  NULL,     PV_PIP,        80, 200, 25, 27,  NULL,          FIELDS(qpgs_fields),     0,          0, 0, 0 },
+    { "QET",    NULL,     PV_MKS|PV_MAX,  1,  12,  1,  1,  "0123456789",  FIELDS(energy_fields),   0,          0, 0, 0 },
+    { "QEY",    "%Y",     PV_MKS|PV_MAX,  1,  12,  1,  1,  "0123456789",  FIELDS(energy_fields),   0,          0, 0, 0 },
+    { "QEM",    "%Y%m",   PV_MKS|PV_MAX,  1,  12,  1,  1,  "0123456789",  FIELDS(energy_fields),   0,          0, 0, 0 },
+    { "QED",    "%Y%m%d", PV_MKS|PV_MAX,  1,  12,  1,  1,  "0123456789",  FIELDS(energy_fields),   0,          0, 0, 0 },
+};
+
+#define NCOMMANDS (int)(sizeof(commands) / sizeof(commands[0]))
+
+int ProtoCommandCount() {
+    return NCOMMANDS;
+}
+
+const ProtoCommand *ProtoCommandAt(int i) {
+    return &commands[i];
+}
+
+const ProtoCommand *ProtoFind(const char *cmd) {
+    for (int i = 0; i < NCOMMANDS; i++) {
+        const char *name = commands[i].name;
+        size_t n = strlen(name);
+        if (name[n - 1] == '#') {
+            // Template: the prefix, then nothing but digits
+            if (!strncmp(cmd, name, n - 1) && cmd[n - 1] && strspn(cmd + n - 1, "0123456789") == strlen(cmd + n - 1))
+                return &commands[i];
+        } else if (!strcmp(cmd, name)) {
+            return &commands[i];
+        } else if (commands[i].arg && !strncmp(cmd, name, n) && strspn(cmd + n, "0123456789") == strlen(cmd + n)) {
+            return &commands[i];    // as sent, with its date
+        }
+    }
+    return NULL;
+}
+
+int ProtoVariant(const char *name) {
+    static const struct { const char *name; int variant; } variants[] = {
+        { "vm3", PV_VM3 }, { "mks", PV_MKS }, { "pip", PV_PIP }, { "max", PV_MAX },
+    };
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++)
+        if (!strcmp(name, variants[i].name))
+            return variants[i].variant;
+    return 0;
+}
+
+bool ProtoMatch(const ProtoCommand *pc, const char *reply) {
+    if (!pc || !strcmp(reply, "NAK"))
+        return true;
+
+    int fields = 0, len = 0;
+    bool in_field = false;
+    for (const char *p = reply; *p; p++, len++) {
+        if (*p == ' ') {
+            in_field = false;
+            continue;
+        }
+        if (pc->charset && !strchr(pc->charset, *p))
+            return false;
+        if (!in_field)
+            fields++;
+        in_field = true;
+    }
+    return len >= pc->min_len && len <= pc->max_len && fields >= pc->min_fields && fields <= pc->max_fields;
+}
+
+void ProtoCommandText(const ProtoCommand *pc, const char *cmd, char *out, int len) {
+    int n = snprintf(out, len, "%s", cmd);
+    // Only the bare name gets today's date; QED20260101 (-r, control socket) goes out as is
+    if (!pc || !pc->arg || strcmp(cmd, pc->name) || n < 0 || n >= len)
+        return;
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(out + n, len - n, pc->arg, &tm);
+}
+
+int ProtoModeNumber(char mode) {
+    switch (mode) {
+        case 'P': return 1;     // Power_On
+        case 'S': return 2;     // Standby
+        case 'L': return 3;     // Line
+        case 'B': return 4;     // Battery
+        case 'F': return 5;     // Fault
+        case 'H': return 6;     // Power_Saving
+        default:  return 0;     // Unknown
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef ___PROTOCOL_H
+#define ___PROTOCOL_H
+
+#include <stddef.h>
+
+// Registry of the protocol's query commands, compiled in.
+// One entry per command says what its reply looks like (length, field count, allowed
+// characters - used to tell a reply from a late one), how to parse it (field names, types,
+// scale factors and where each value is stored), which firmware variants have it and how
+// often it is polled by default.  Poller, parser and emitters are all driven from it; a new
+// extra query command is a new table entry.
+//
+// QMOD, QPIGS, QPIRI and QPIWS make up the classic sample and are parsed into the typed
+// structs of parser.h.  Their published names are kept in output.cpp, which takes each
+// field's type and position from here; a new field of theirs is published once it is named
+// there.  Every other command is an "extra": its values are kept as floats in a ProtoValues
+// and published as <command>_<field>.
+
+#define PROTO_MAX_FIELDS 32
+#define PROTO_MAX_EXTRAS 8      // extra commands polled per inverter
+
+// Firmware variants, selected with protocol= in inverter.conf
+enum {
+    PV_VM3 = 1,     // Axpert VM III and the like (default)
+    PV_MKS = 2,     // Axpert MKS / King
+    PV_PIP = 4,     // PIP parallel capable models
+    PV_MAX = 8,     // Axpert MAX, two PV inputs
+    PV_ALL = 15
+};
+
+enum {
+    PF_INT,         // int
+    PF_FLOAT,       // float
+    PF_FLAGS,       // '0'/'1' string of 'width' flags, stored NUL terminated (char[width + 1])
+    PF_BITS,        // '0'/'1' string, stored as its value (float, extras)
+    PF_MODE,        // mode letter, stored as the mode number (float in extras, int Sample::mode)
+    PF_SKIP         // present, not stored (e.g. serial numbers)
+};
+
+struct ProtoField {
+    const char *name;
+    int type;
+    int width;              // PF_FLAGS
+    float scale;            // PF_FLOAT values are multiplied by it when parsed
+    size_t offset;          // into the reply struct (typed) or ProtoValues (extras)
+};
+
+struct ProtoCommand {
+    const char *name;       // as sent; a trailing '#' stands for a number: QPGS# is QPGS0, QPGS1...
+    const char *arg;        // strftime() format of today's date appended when sent, or NULL
+    int variants;           // PV_* bits of the firmware that knows it
+    int min_len, max_len;   // reply payload bytes
+    int min_fields, max_fields;
+    const char *charset;    // if set, the only characters a reply may hold
+    const ProtoField *fields;
+    int nfields;
+    int have;               // HAVE_* bit of the classic sample commands, 0 for extras
+    int period;             // default schedule (ms, priority, max ms); 0 = only with poll_<cmd>=
+    int priority;
+    int max_period;
+};
+
+// Values of an extra command's reply; missing fields are -1
+struct ProtoValues {
+    int count;
+    float v[PROTO_MAX_FIELDS];
+};
+
+int ProtoCommandCount();
+const ProtoCommand *ProtoCommandAt(int i);
+
+// Entry for a command as configured or sent (QPGS2 finds QPGS#, QED20260101 finds QED),
+// NULL if unknown
+const ProtoCommand *ProtoFind(const char *cmd);
+
+int ProtoVariant(const char *name);         // "vm3", "mks", "pip", "max"; 0 if unknown
+
+// Is 'reply' (without '(' and CRC) what 'pc' answers?  Unknown commands accept anything,
+// NAK is a valid answer to everything.
+bool ProtoMatch(const ProtoCommand *pc, const char *reply);
+
+// The text actually sent for 'cmd': a command with a date argument that is given by its bare
+// name gets today's date appended, anything else (QED20260101) is sent unchanged
+void ProtoCommandText(const ProtoCommand *pc, const char *cmd, char *out, int len);
+
+int ProtoModeNumber(char mode);             // QMOD letter to the published mode number
+
+#endif // ___PROTOCOL_H
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "scheduler.h"
+#include "tools.h"
+
+using namespace std::chrono;
+
+// Parses "<period ms>,<priority>[,<max period ms>]" as given in inverter.conf
+bool cScheduler::Configure(const std::string &cmd, const std::string &spec) {
+    int period = 0, priority = 0, max_period = 0;
+
+    if (sscanf(spec.c_str(), "%d,%d,%d", &period, &priority, &max_period) < 1 || period <= 0) {
+        lerror("INVERTER: Bad poll schedule for %s: '%s'", cmd.c_str(), spec.c_str());
+        return false;
+    }
+    Add(cmd, period, priority, max_period);
+    return true;
+}
+
+void cScheduler::Add(const std::string &cmd, int period, int priority, int max_period) {
+    Entry *e = NULL;
+
+    // A later setting for the same command replaces the earlier one
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].cmd == cmd)
+            e = &entries[i];
+    if (!e) {
+        entries.push_back(Entry());
+        e = &entries.back();
+        e->cmd = cmd;
+        e->runs = 0;
+        e->fails = 0;
+    }
+
+    e->period = period;
+    e->priority = priority;
+    e->max_period = max_period > period ? max_period : period;
+    e->cur_period = period;
+    e->next_due = clock::now();
+    e->last_reply.clear();
+}
+
+// Returns the due command with the highest priority (oldest due time breaks ties),
+// or NULL with *wait_ms set to the time until the next command becomes due.
+cScheduler::Entry *cScheduler::Next(int *wait_ms) {
+    clock::time_point now = clock::now();
+    Entry *best = NULL;
+    Entry *soonest = NULL;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        Entry *e = &entries[i];
+        if (e->next_due == clock::time_point::max())
+            continue;           // one-shot, done with
+        if (e->next_due <= now) {
+            if (!best || e->priority > best->priority ||
+                (e->priority == best->priority && e->next_due < best->next_due))
+                best = e;
+        } else if (!soonest || e->next_due < soonest->next_due) {
+            soonest = e;
+        }
+    }
+
+    if (best || !soonest) {
+        *wait_ms = best ? 0 : 1000;
+        return best;
+    }
+    *wait_ms = duration_cast<milliseconds>(soonest->next_due - now).count() + 1;
+    return NULL;
+}
+
+// Every due command, in the order Next() would hand them out
+void cScheduler::Due(std::vector<Entry*> &out) {
+    clock::time_point now = clock::now();
+
+    out.clear();
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].next_due <= now)
+            out.push_back(&entries[i]);
+    std::sort(out.begin(), out.end(), [](const Entry *a, const Entry *b) {
+        return a->priority > b->priority || (a->priority == b->priority && a->next_due < b->next_due);
+    });
+}
+
+void cScheduler::Done(Entry *e, bool ok, const char *reply) {
+    if (once_tries) {
+        if (ok)
+            e->runs++;
+        else
+            e->fails++;
+        e->next_due = ok || e->fails >= once_tries ? clock::time_point::max() : clock::now();
+        return;
+    }
+
+    if (!ok) {
+        // Failed queries come back soon (RETRY_MIN, doubling, at most the base period): one
+        // lost QPIRI must not hold back every sample for its full minute.  The backoff of
+        // unchanged replies starts over.
+        e->fails++;
+        e->cur_period = e->period;
+        int retry = e->fails < 8 ? RETRY_MIN << (e->fails - 1) : e->period;
+        e->next_due = clock::now() + milliseconds(retry < e->period ? retry : e->period);
+        return;
+    }
+
+    e->fails = 0;
+    e->runs++;
+    if (e->last_reply == reply) {
+        e->cur_period *= 2;
+        if (e->cur_period > e->max_period)
+            e->cur_period = e->max_period;
+    } else {
+        e->cur_period = e->period;
+        e->last_reply = reply;
+    }
+    e->next_due = clock::now() + milliseconds(e->cur_period);
+}
+
+// Every command has run (in a one-shot: or has given up)
+bool cScheduler::AllRan() {
+    for (size_t i = 0; i < entries.size(); i++)
+        if (!entries[i].runs && !(once_tries && entries[i].fails >= once_tries))
+            return false;
+    return true;
+}
+
+void cScheduler::Commands(std::vector<std::string> &out) const {
+    out.clear();
+    for (size_t i = 0; i < entries.size(); i++)
+        out.push_back(entries[i].cmd);
+}
+
+void cScheduler::Once(int tries) {
+    once_tries = tries;
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].fails = 0;
+        entries[i].next_due = clock::now();
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef ___SCHEDULER_H
+#define ___SCHEDULER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Decides which query goes out on the serial link next.
+// Every command has its own base period and priority.  When a command keeps returning
+// the same reply its period is doubled (up to max_period), so slow moving data such as
+// QPIRI ratings stops eating link time that QPIGS can use instead.  A failed query is retried
+// after RETRY_MIN, doubling with every further failure up to its base period.
+
+class cScheduler {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        struct Entry {
+            std::string cmd;
+            int period;         // base interval (ms)
+            int max_period;     // backoff ceiling for unchanged replies (ms)
+            int priority;       // higher runs first when several commands are due
+            int cur_period;     // current interval including backoff (ms)
+            int runs;
+            int fails;          // in a row
+            clock::time_point next_due;
+            std::string last_reply;
+        };
+
+        cScheduler() : once_tries(0) {}
+
+        static const int RETRY_MIN = 250;   // ms before the first retry of a failed query
+
+        bool Configure(const std::string &cmd, const std::string &spec);
+        void Add(const std::string &cmd, int period, int priority, int max_period = 0);
+
+        Entry *Next(int *wait_ms);
+        void Due(std::vector<Entry*> &out);
+        void Done(Entry *e, bool ok, const char *reply);
+        bool AllRan();
+        void Commands(std::vector<std::string> &out) const;
+
+        // One-shot: every command goes out back to back until it succeeded once or failed
+        // 'tries' times in a row, then never again
+        void Once(int tries);
+
+    private:
+        std::vector<Entry> entries;
+        int once_tries;         // 0: normal schedule
+};
+
+#endif // ___SCHEDULER_H
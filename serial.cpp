@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include "serial.h"
+#include "tools.h"
+
+bool cSerialPort::configure() {
+    // Once connected, set the baud rate and other serial config (Don't rely on this being correct on the system by default...)
+    speed_t baud = B2400;
+
+    // Speed settings (in this case, 2400 8N1)
+    struct termios settings;
+    if (tcgetattr(fd, &settings) == -1)
+        return errno == ENOTTY;    // not a tty after all - nothing to configure
+
+    cfsetspeed(&settings, baud);      // baud rate
+    settings.c_cflag &= ~PARENB;       // no parity
+    settings.c_cflag &= ~CSTOPB;       // 1 stop bit
+    settings.c_cflag &= ~CSIZE;        // Clear all bits that set the data size
+    settings.c_cflag |= CS8 | CLOCAL;  // 8 bits
+
+    settings.c_oflag &= ~OPOST;        // Prevent special interpretation of output bytes (e.g. newline chars)
+    settings.c_lflag &= ~ICANON;
+    settings.c_iflag &= ~(IXON | IXOFF | IXANY); // Turn off s/w flow ctrl
+    settings.c_lflag &= ~ISIG;
+    settings.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
+    settings.c_lflag &= ~ECHO;             // turn off Echo input characters.
+    settings.c_lflag &= ~IEXTEN;           // disable implementation-defined input processing.
+    settings.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL); // Disable any special handling of received bytes
+    if (tcsetattr(fd, TCSANOW, &settings) == -1) // apply the settings
+        return false;
+    tcflush(fd, TCIOFLUSH);
+    return true;
+}
+
+bool cSerialPort::Write(const void *data, int len) {
+    const unsigned char *p = (const unsigned char*)data;
+
+    while (len > 0) {
+        int n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                // Output queue full - wait until the line drains a bit
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                ::poll(&pfd, 1, 100);
+                continue;
+            }
+            lwarn("INVERTER: write to %s failed (errno=%d %s)", device.data(), errno, strerror(errno));
+            Disconnect();
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+int cSerialPort::Read(void *data, int len, int timeout_ms) {
+    int r = wait(POLLIN, timeout_ms);
+    if (r <= 0)
+        return r;
+
+    int n = read(fd, data, len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        // Readable but nothing to read means the other end hung up
+        lwarn("INVERTER: read from %s failed (n=%d errno=%d %s)", device.data(), n, errno, strerror(errno));
+        Disconnect();
+        return -1;
+    }
+    return n;
+}
+
+void cSerialPort::FlushInput() {
+    tcflush(fd, TCIFLUSH);
+}
+
+void cSerialPort::FlushOutput() {
+    tcflush(fd, TCOFLUSH);
+}
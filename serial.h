@@ -0,0 +1,20 @@
+#ifndef ___SERIAL_H
+#define ___SERIAL_H
+
+#include "transport.h"
+
+// RS232 / USB<>serial adapter: a termios tty set to 2400 8N1, raw.
+
+class cSerialPort : public cTransport {
+    bool configure();
+
+    public:
+        cSerialPort(std::string devicename) : cTransport(devicename) {}
+
+        bool Write(const void *data, int len);
+        int Read(void *data, int len, int timeout_ms);
+        void FlushInput();
+        void FlushOutput();
+};
+
+#endif // ___SERIAL_H
@@ -0,0 +1,232 @@
+// Fake inverter on a pseudo-terminal, for testing and benchmarking the poller without hardware.
+// Build target: inverter_sim
+//
+//   inverter_sim -l /tmp/inverter [-f replies.txt] [-t <latency ms>] [-b <baud>]
+//                [-D <pct>] [-C <pct>] [-N <pct>] [-s <seed>] [-v]
+//
+// Creates a pty, links its slave side to the -l path (use it as 'device=' in inverter.conf)
+// and answers the Voltronic protocol with correct CRCs.  Every request is checked for a
+// valid CRC; unknown queries get NAK, setters (P..., M...) get ACK.
+// Faults are injected per reply with the given probability: -D drops one byte, -C corrupts
+// the CRC, -N leaves out the terminating CR.  -b paces the output like a serial line of
+// that speed (10 bit times per byte), -t waits before every reply.
+// ------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "crc.h"
+#include "inputparser.h"
+
+// Default replies of an Axpert VM3, used for anything not given in the replay file
+static const char *defaults[][2] = {
+    { "QMOD",  "(B" },
+    { "QPIGS", "(230.0 50.0 230.0 50.0 0161 0119 003 460 57.50 012 100 0069 0014 103.8 57.45 00000 00110110 00 00 00856 010" },
+    { "QPIRI", "(230.0 21.7 230.0 50.0 21.7 5000 4000 48.0 46.0 42.0 56.4 54.0 0 10 010 1 0 0 6 01 0 0 54.0 0 1" },
+    { "QPIWS", "(00000000000000000000000000000000" },
+    { "QPI",   "(PI30" },
+};
+
+struct Replies {
+    std::vector<std::string> list;
+    size_t next;
+};
+
+static std::map<std::string, Replies> replies;
+static volatile sig_atomic_t quit = 0;
+
+static int latency_ms = 0;
+static int baud = 0;
+static int drop_pct = 0, crc_pct = 0, nocr_pct = 0;
+static bool verbose = false;
+
+static unsigned long requests, bad_requests, dropped, crc_errors, missing_cr;
+
+static void on_signal(int) {
+    quit = 1;
+}
+
+static bool chance(int pct) {
+    return pct > 0 && rand() % 100 < pct;
+}
+
+// Replay file: "<command> <reply>" per line, reply with the leading '(' and without CRC.
+// Several lines for the same command are replayed in turn.
+static bool load_replies(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[1024];
+    int n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        char *sp = strchr(line, ' ');
+        if (line[0] == '#' || !sp || sp[1] != '(')
+            continue;
+        *sp = 0;
+        replies[line].list.push_back(sp + 1);
+        n++;
+    }
+    fclose(f);
+    fprintf(stderr, "Loaded %d replies from %s\n", n, path);
+    return true;
+}
+
+static void sleep_us(long us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR && !quit)
+        ;
+}
+
+static void send_frame(int master, std::string frame) {
+    if (chance(drop_pct) && frame.size() > 1) {
+        frame.erase(1 + rand() % (frame.size() - 1), 1);
+        dropped++;
+    }
+    if (!baud) {
+        if (write(master, frame.data(), frame.size()) != (ssize_t)frame.size())
+            perror("write");
+        return;
+    }
+    // One byte at a time, spaced like start + 8 data + stop bits on the wire
+    long byte_us = 10 * 1000000L / baud;
+    for (size_t i = 0; i < frame.size() && !quit; i++) {
+        if (write(master, &frame[i], 1) != 1)
+            perror("write");
+        sleep_us(byte_us);
+    }
+}
+
+static void answer(int master, const std::string &req) {
+    requests++;
+
+    // <command> <crc hi> <crc lo>
+    if (req.size() < 3 || cal_crc((const uint8_t*)req.data(), req.size() - 2) !=
+            (((uint8_t)req[req.size() - 2] << 8) | (uint8_t)req[req.size() - 1])) {
+        bad_requests++;
+        if (verbose)
+            fprintf(stderr, "RX bad CRC: %s\n", req.c_str());
+        return;     // a real inverter stays silent too
+    }
+
+    std::string cmd = req.substr(0, req.size() - 2);
+    std::string payload;
+    std::map<std::string, Replies>::iterator it = replies.find(cmd);
+    if (it != replies.end()) {
+        payload = it->second.list[it->second.next++ % it->second.list.size()];
+    } else {
+        payload = cmd[0] == 'P' || cmd[0] == 'M' ? "(ACK" : "(NAK";
+    }
+
+    uint16_t crc = cal_crc((const uint8_t*)payload.data(), payload.size());
+    if (chance(crc_pct)) {
+        crc = crc_escape(crc ^ 0x0101);
+        crc_errors++;
+    }
+    std::string frame = payload;
+    frame += (char)(crc >> 8);
+    frame += (char)(crc & 0xff);
+    if (chance(nocr_pct))
+        missing_cr++;
+    else
+        frame += '\r';
+
+    if (verbose)
+        fprintf(stderr, "RX %s -> %s\n", cmd.c_str(), payload.c_str());
+    if (latency_ms)
+        sleep_us(latency_ms * 1000L);
+    send_frame(master, frame);
+}
+
+int main(int argc, char* argv[]) {
+    InputParser args(argc, argv);
+    const std::string &link = args.getCmdOption("-l");
+    unsigned seed = time(NULL);
+
+    if (link.empty() || args.cmdOptionExists("-h")) {
+        fprintf(stderr, "USAGE: inverter_sim -l <link path> [-f <replay file>] [-t <latency ms>] [-b <baud>]\n"
+                        "                    [-D <drop %%>] [-C <crc error %%>] [-N <missing CR %%>] [-s <seed>] [-v]\n");
+        return 1;
+    }
+    sscanf(args.getCmdOption("-t").c_str(), "%d", &latency_ms);
+    sscanf(args.getCmdOption("-b").c_str(), "%d", &baud);
+    sscanf(args.getCmdOption("-D").c_str(), "%d", &drop_pct);
+    sscanf(args.getCmdOption("-C").c_str(), "%d", &crc_pct);
+    sscanf(args.getCmdOption("-N").c_str(), "%d", &nocr_pct);
+    sscanf(args.getCmdOption("-s").c_str(), "%u", &seed);
+    verbose = args.cmdOptionExists("-v");
+    srand(seed);
+
+    if (args.cmdOptionExists("-f") && !load_replies(args.getCmdOption("-f").c_str()))
+        return 1;
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+        if (!replies.count(defaults[i][0]))
+            replies[defaults[i][0]].list.push_back(defaults[i][1]);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        perror("posix_openpt");
+        return 1;
+    }
+    const char *slave_name = ptsname(master);
+
+    // Keep a slave fd open: raw mode from the start, and no hangup between poller runs
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave == -1 || tcgetattr(slave, &tio) == -1) {
+        perror(slave_name);
+        return 1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    unlink(link.c_str());
+    if (symlink(slave_name, link.c_str()) == -1) {
+        perror(link.c_str());
+        return 1;
+    }
+    fprintf(stderr, "Simulating an inverter on %s (%s), seed %u\n", link.c_str(), slave_name, seed);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    std::string rx;
+    char buf[256];
+    while (!quit) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        if (poll(&pfd, 1, 500) <= 0)
+            continue;
+        int n = read(master, buf, sizeof(buf));
+        if (n <= 0)
+            continue;
+        rx.append(buf, n);
+
+        size_t cr;
+        while ((cr = rx.find('\r')) != std::string::npos) {
+            answer(master, rx.substr(0, cr));
+            rx.erase(0, cr + 1);
+        }
+        if (rx.size() > 1024)
+            rx.clear();
+    }
+
+    unlink(link.c_str());
+    fprintf(stderr, "%lu requests (%lu with a bad CRC), injected: %lu dropped bytes, %lu CRC errors, %lu missing CR\n",
+            requests, bad_requests, dropped, crc_errors, missing_cr);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef ___SNAPSHOT_H
+#define ___SNAPSHOT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+
+#define REPLY_MAX 256
+
+enum {
+    HAVE_QMOD   = 1,
+    HAVE_QPIGS  = 2,
+    HAVE_QPIRI  = 4,
+    HAVE_QPIWS  = 8,
+    HAVE_SAMPLE = HAVE_QMOD | HAVE_QPIGS | HAVE_QPIRI   // enough for a complete sample
+};
+
+// Latest known state of one inverter, as published by the poller thread.
+// Reply strings are stored without the leading '(' and without CRC/CR.
+struct InverterSnapshot {
+    unsigned long version;  // bumped for every published sample
+    int have;               // HAVE_* bits of the replies received so far
+    char mode;              // raw QMOD reply character
+    int64_t qpigs_time;     // steady clock, ms, when the QPIGS reply was read
+    char qpigs[REPLY_MAX];
+    char qpiri[REPLY_MAX];
+    char qpiws[REPLY_MAX];
+    int ext_have;           // bit i: ext[i] holds a reply
+    char ext[PROTO_MAX_EXTRAS][REPLY_MAX];    // latest replies of the extra commands, see cInverter::Extras()
+};
+
+// Single writer / many readers sequence lock.
+// The writer never blocks and readers never lock or allocate: a reader copies the data and
+// retries if the sequence number shows that a write happened in the meantime.
+template <class T>
+class cSeqlock {
+    std::atomic<unsigned> seq;
+    T data;
+
+    public:
+        cSeqlock() : seq(0) { memset(&data, 0, sizeof(data)); }
+
+        void Store(const T &value) {
+            unsigned s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);    // odd: write in progress
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(&data, &value, sizeof(T));
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        void Load(T *out) const {
+            unsigned s1, s2;
+            do {
+                s1 = seq.load(std::memory_order_acquire);
+                if (s1 & 1)
+                    continue;
+                memcpy(out, &data, sizeof(T));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                s2 = seq.load(std::memory_order_relaxed);
+                if (s1 == s2)
+                    return;
+            } while (true);
+        }
+};
+
+// Wakes up the consumer whenever any of the inverters sharing it publishes a sample or
+// finishes.  Events are counted, so a notification that arrives before Wait() is not lost.
+class cNotifier {
+    std::mutex m;
+    std::condition_variable cv;
+    unsigned long events;
+
+    public:
+        cNotifier() : events(0) {}
+
+        void Notify() {
+            m.lock();
+            events++;
+            m.unlock();
+            cv.notify_all();
+        }
+
+        // Blocks until the event count differs from 'seen', returns the new count
+        unsigned long Wait(unsigned long seen) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [this, seen] { return events != seen; });
+            return events;
+        }
+};
+
+#endif // ___SNAPSHOT_H
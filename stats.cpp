@@ -0,0 +1,135 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "inverter.h"
+
+const int stats_bounds_ms[STATS_BUCKETS - 1] = { 10, 25, 50, 100, 250, 500, 1000, 2000, 5000 };
+
+cHistogram::cHistogram() : sum_us(0) {
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        buckets[i] = 0;
+}
+
+void cHistogram::Add(int64_t us) {
+    int i = 0;
+    while (i < STATS_BUCKETS - 1 && us > stats_bounds_ms[i] * 1000LL)
+        i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+unsigned long cHistogram::Count() const {
+    unsigned long n = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        n += buckets[i].load(std::memory_order_relaxed);
+    return n;
+}
+
+cStats::cStats() : ncmds(0), bytes_read(0), timeouts(0), crc_errors(0), bad_start(0),
+                   late_frames(0) {
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        cmds[i].cmd[0] = 0;
+        cmds[i].errors = 0;
+    }
+}
+
+CommandStats *cStats::Command(const char *cmd) {
+    int n = ncmds.load(std::memory_order_relaxed);
+
+    for (int i = 0; i < n; i++)
+        if (!strcmp(cmds[i].cmd, cmd))
+            return &cmds[i];
+
+    // Raw commands can be anything; keep the last slot for all of them once we run out
+    if (n == STATS_COMMANDS)
+        return &cmds[n - 1];
+    snprintf(cmds[n].cmd, sizeof(cmds[n].cmd), "%s", n == STATS_COMMANDS - 1 ? "other" : cmd);
+    ncmds.store(n + 1, std::memory_order_release);
+    return &cmds[n];
+}
+
+// ---------------------------------------------------------------
+
+static void append(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *format, ...) {
+    char line[512];
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    out.append(line, n < (int)sizeof(line) ? n : sizeof(line) - 1);
+}
+
+static void header(std::string &out, const char *name, const char *type, const char *help) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void histogram(std::string &out, const char *name, const char *labels, const cHistogram &h) {
+    unsigned long cumulative = 0;
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        cumulative += h.buckets[i].load(std::memory_order_relaxed);
+        if (i < STATS_BUCKETS - 1)
+            append(out, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, stats_bounds_ms[i] / 1000.0, cumulative);
+        else
+            append(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, cumulative);
+    }
+    append(out, "%s_sum{%s} %.6f\n", name, labels, h.sum_us.load(std::memory_order_relaxed) / 1e6);
+    append(out, "%s_count{%s} %lu\n", name, labels, cumulative);
+}
+
+void stats_format(const std::vector<cInverter*> &units, std::string &out) {
+    char labels[256];
+    out.clear();
+
+    header(out, "inverter_query_duration_seconds", "histogram", "Round trip time of successful queries");
+    for (size_t u = 0; u < units.size(); u++) {
+        const cStats &st = units[u]->Stats();
+        for (int i = 0; i < st.Commands(); i++) {
+            snprintf(labels, sizeof(labels), "unit=\"%d\",command=\"%s\"", units[u]->Unit(), st.CommandAt(i).cmd);
+            histogram(out, "inverter_query_duration_seconds", labels, st.CommandAt(i).latency);
+        }
+    }
+
+    header(out, "inverter_query_errors_total", "counter", "Failed queries (timeout, bad start byte, CRC)");
+    for (size_t u = 0; u < units.size(); u++) {
+        const cStats &st = units[u]->Stats();
+        for (int i = 0; i < st.Commands(); i++)
+            append(out, "inverter_query_errors_total{unit=\"%d\",command=\"%s\"} %lu\n", units[u]->Unit(),
+                   st.CommandAt(i).cmd, st.CommandAt(i).errors.load(std::memory_order_relaxed));
+    }
+
+    header(out, "inverter_sample_interval_seconds", "histogram", "Time between consecutive QPIGS replies");
+    for (size_t u = 0; u < units.size(); u++) {
+        snprintf(labels, sizeof(labels), "unit=\"%d\"", units[u]->Unit());
+        histogram(out, "inverter_sample_interval_seconds", labels, units[u]->Stats().sample_interval);
+    }
+
+    struct {
+        const char *name;
+        const char *help;
+        const std::atomic<unsigned long> cStats::*counter;
+    } counters[] = {
+        { "inverter_bytes_read_total",  "Bytes read from the device",                     &cStats::bytes_read },
+        { "inverter_timeouts_total",    "Queries without a reply before the timeout",     &cStats::timeouts },
+        { "inverter_crc_errors_total",  "Frames with a bad CRC",                          &cStats::crc_errors },
+        { "inverter_bad_start_total",   "Garbage skipped while looking for a '('",        &cStats::bad_start },
+        { "inverter_late_frames_total", "Frames discarded as a late reply to an earlier command", &cStats::late_frames },
+    };
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        header(out, counters[c].name, "counter", counters[c].help);
+        for (size_t u = 0; u < units.size(); u++)
+            append(out, "%s{unit=\"%d\"} %lu\n", counters[c].name, units[u]->Unit(),
+                   (units[u]->Stats().*counters[c].counter).load(std::memory_order_relaxed));
+    }
+
+    header(out, "inverter_opens_total", "counter", "Successful opens of the device (reconnects + 1)");
+    for (size_t u = 0; u < units.size(); u++)
+        append(out, "inverter_opens_total{unit=\"%d\"} %lu\n", units[u]->Unit(), units[u]->Port().Opens());
+    header(out, "inverter_open_failures_total", "counter", "Failed attempts to open the device");
+    for (size_t u = 0; u < units.size(); u++)
+        append(out, "inverter_open_failures_total{unit=\"%d\"} %lu\n", units[u]->Unit(), units[u]->Port().Failures());
+}
@@ -0,0 +1,58 @@
+#ifndef ___STATS_H
+#define ___STATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Always-on counters of one inverter's poller.
+// Only the poller thread writes them; readers (the metrics endpoint) may look at any time.
+// Everything is a relaxed atomic add, cheap enough to stay enabled without -d.
+
+#define STATS_BUCKETS  10       // latency buckets, see stats_bounds_ms
+#define STATS_COMMANDS 16       // distinct commands tracked, the rest is counted as "other"
+
+extern const int stats_bounds_ms[STATS_BUCKETS - 1];   // upper bounds; the last bucket is +Inf
+
+struct cHistogram {
+    std::atomic<unsigned long> buckets[STATS_BUCKETS];
+    std::atomic<uint64_t> sum_us;
+
+    cHistogram();
+    void Add(int64_t us);
+    unsigned long Count() const;
+};
+
+struct CommandStats {
+    char cmd[16];
+    cHistogram latency;                 // round trip of successful queries
+    std::atomic<unsigned long> errors;  // timeouts, CRC and start byte failures
+};
+
+class cStats {
+    CommandStats cmds[STATS_COMMANDS];
+    std::atomic<int> ncmds;
+
+    public:
+        std::atomic<unsigned long> bytes_read;
+        std::atomic<unsigned long> timeouts;
+        std::atomic<unsigned long> crc_errors;
+        std::atomic<unsigned long> bad_start;     // runs of bytes skipped looking for a '('
+        std::atomic<unsigned long> late_frames;   // good frames that were no reply to the command sent
+        cHistogram sample_interval;     // time between consecutive QPIGS replies
+
+        cStats();
+
+        // Poller thread only: the entry for 'cmd', added on first use
+        CommandStats *Command(const char *cmd);
+        int Commands() const { return ncmds.load(std::memory_order_acquire); }
+        const CommandStats &CommandAt(int i) const { return cmds[i]; }
+};
+
+class cInverter;
+
+// Prometheus text exposition format of every unit's counters
+void stats_format(const std::vector<cInverter*> &units, std::string &out);
+
+#endif // ___STATS_H
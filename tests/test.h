@@ -0,0 +1,20 @@
+#ifndef ___TEST_H
+#define ___TEST_H
+
+#include <stdio.h>
+
+// Minimal checks for the ctest programs: a failed CHECK() prints where and why and makes
+// TEST_RESULT() non-zero, the test carries on so one run shows every failure.
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() (test_failures ? (fprintf(stderr, "%d check(s) failed\n", test_failures), 1) : 0)
+
+#endif // ___TEST_H
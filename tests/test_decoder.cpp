@@ -0,0 +1,79 @@
+// cFrameDecoder: frames at and beyond FRAME_MAX, resync after noise
+#include <string.h>
+#include <string>
+#include "../crc.h"
+#include "../decoder.h"
+#include "test.h"
+
+// '(' + payload + CRC + CR, as the inverter sends it
+static std::string make_frame(const std::string &payload) {
+    std::string f = "(" + payload;
+    uint16_t crc = cal_crc((const uint8_t*)f.data(), f.size());
+    f += (char)(crc >> 8);
+    f += (char)(crc & 0xff);
+    f += '\r';
+    return f;
+}
+
+// Feeds 'wire' and returns the first event that is not GARBAGE
+static int decode(cFrameDecoder &dec, const std::string &wire, int *len, int *garbage) {
+    const unsigned char *frame;
+    int r;
+
+    dec.Feed((const unsigned char*)wire.data(), wire.size());
+    *garbage = 0;
+    while ((r = dec.Next(&frame, len)) == cFrameDecoder::GARBAGE)
+        *garbage += *len;
+    return r;
+}
+
+int main() {
+    cFrameDecoder dec;
+    int len, garbage;
+
+    // A plain reply
+    std::string f = make_frame("B");
+    CHECK(decode(dec, f, &len, &garbage) == cFrameDecoder::FRAME);
+    CHECK(len == (int)f.size() && garbage == 0);
+
+    // The longest frame there is: FRAME_MAX bytes, CR included
+    dec.Reset();
+    f = make_frame(std::string(cFrameDecoder::FRAME_MAX - 4, '1'));
+    CHECK((int)f.size() == cFrameDecoder::FRAME_MAX);
+    CHECK(decode(dec, f, &len, &garbage) == cFrameDecoder::FRAME);
+    CHECK(len == cFrameDecoder::FRAME_MAX && garbage == 0);
+
+    // One byte longer: exactly FRAME_MAX bytes before the CR.  Must be dropped as garbage
+    // without the CR ever being taken into frame_buf.
+    dec.Reset();
+    f = make_frame(std::string(cFrameDecoder::FRAME_MAX - 3, '1'));
+    CHECK((int)f.size() == cFrameDecoder::FRAME_MAX + 1);
+    CHECK(decode(dec, f, &len, &garbage) == cFrameDecoder::MORE);
+    CHECK(garbage == cFrameDecoder::FRAME_MAX + 1);
+    CHECK(dec.Buffered() == 0);
+
+    // A good frame right behind the oversized one is still found
+    dec.Reset();
+    std::string good = make_frame("230.0 50.0");
+    f = make_frame(std::string(cFrameDecoder::FRAME_MAX - 3, '1')) + good;
+    CHECK(decode(dec, f, &len, &garbage) == cFrameDecoder::FRAME);
+    CHECK(len == (int)good.size());
+
+    // Noise and a reply that lost its CR in front of a good one
+    dec.Reset();
+    f = std::string("\x01\x02xyz") + "(NAK" + good;
+    const unsigned char *frame;
+    dec.Feed((const unsigned char*)f.data(), f.size());
+    int r, frames = 0, bad = 0;
+    while ((r = dec.Next(&frame, &len)) != cFrameDecoder::MORE) {
+        if (r == cFrameDecoder::FRAME) {
+            frames++;
+            CHECK(len == (int)good.size() && !memcmp(frame, good.data(), len));
+        } else if (r == cFrameDecoder::BAD_CRC) {
+            bad++;
+        }
+    }
+    CHECK(frames == 1 && bad == 1);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,71 @@
+// cHidrawPort::Read() with caller buffers smaller than a report.  A SOCK_SEQPACKET pair
+// stands in for the hidraw node: like it, every read() returns exactly one report.
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <string>
+#include "../hidraw.h"
+#include "test.h"
+
+class cTestPort : public cHidrawPort {
+    public:
+        cTestPort(int sock) : cHidrawPort("test") { fd = sock; }
+};
+
+// The inverter's side: 8 byte reports, zero padded after the CR
+static void send_reply(int sock, const std::string &reply) {
+    for (size_t i = 0; i < reply.size(); i += cHidrawPort::REPORT_SIZE) {
+        unsigned char report[cHidrawPort::REPORT_SIZE];
+        memset(report, 0, sizeof(report));
+        memcpy(report, reply.data() + i, std::min(reply.size() - i, sizeof(report)));
+        CHECK(write(sock, report, sizeof(report)) == sizeof(report));
+    }
+}
+
+// Reads 'len' bytes at a time until the CR or a timeout
+static std::string read_reply(cTestPort &port, int len) {
+    std::string out;
+    char buf[64];
+
+    while (out.find('\r') == std::string::npos) {
+        int n = port.Read(buf, len, 200);
+        if (n <= 0)
+            break;
+        CHECK(n <= len);
+        out.append(buf, n);
+    }
+    return out;
+}
+
+int main() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return 1;
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    cTestPort port(sv[0]);
+
+    const std::string reply = "(230.0 50.0 230.0 50.0 0161 0119\x12\x34\r";
+
+    // Any buffer size gets the whole reply, padding cut off
+    int sizes[] = { 1, 3, 7, 8, 9, 63, 64 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        send_reply(sv[1], reply);
+        CHECK(read_reply(port, sizes[i]) == reply);
+    }
+
+    // A partly taken report is dropped with the rest of the input
+    send_reply(sv[1], reply);
+    char c;
+    CHECK(port.Read(&c, 1, 200) == 1 && c == '(');
+    port.FlushInput();
+    send_reply(sv[1], "(B\x01\x02\r");
+    CHECK(read_reply(port, 2) == "(B\x01\x02\r");
+
+    // Nothing queued: a timeout, not an error
+    CHECK(port.Read(&c, 1, 50) == 0);
+
+    close(sv[1]);
+    return TEST_RESULT();
+}
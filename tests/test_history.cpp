@@ -0,0 +1,76 @@
+// cHistory range queries, also after the wall clock was set back
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "../history.h"
+#include "test.h"
+
+static void append(cHistory &h, int64_t timestamp, float pv_watts) {
+    Sample s;
+    memset(&s, 0, sizeof(s));
+    s.timestamp = timestamp;
+    s.pv_input_watts = pv_watts;
+    h.Append(s);
+}
+
+static int count(const cHistory &h, int64_t from, int64_t to) {
+    std::vector<HistoryRecord> out;
+    h.Query(0, from, to, out);
+    for (size_t i = 0; i < out.size(); i++)
+        CHECK(out[i].timestamp >= from && out[i].timestamp < to);
+    return out.size();
+}
+
+int main() {
+    char path[] = "/tmp/test_history.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        return 1;
+    close(fd);
+    unlink(path);       // Open() creates it
+
+    cHistory h;
+    CHECK(h.Open(path, 16));
+
+    // 0 .. 9 s, in order
+    for (int k = 0; k < 10; k++)
+        append(h, k * 1000, k);
+    CHECK(count(h, 3000, 6000) == 3);
+    CHECK(count(h, 0, 100000) == 10);
+    CHECK(count(h, 9500, 100000) == 0);
+
+    // The clock is set back by 7.5 s: 2.5 .. 4.5 s again
+    append(h, 2500, 100);
+    append(h, 3500, 100);
+    append(h, 4500, 100);
+    CHECK(count(h, 3000, 6000) == 5);       // 3, 3.5, 4, 4.5 and 5 s
+    CHECK(count(h, 0, 100000) == 13);
+
+    // One bucket per 10 s: everything lands in the first one, merged
+    std::vector<HistoryBucket> b;
+    int watts = cHistory::FieldIndex("PV_in_watts");
+    h.Downsample(0, watts, 0, 100000, 10000, b);
+    CHECK(b.size() == 1 && b[0].count == 13 && b[0].max == 100);
+    h.Downsample(0, watts, 0, 100000, 1000, b);
+    CHECK(b.size() == 10);
+    for (size_t i = 1; i < b.size(); i++)
+        CHECK(b[i - 1].start < b[i].start);
+
+    // A reader sees the same
+    cHistory r;
+    CHECK(r.OpenReadOnly(path));
+    CHECK(count(r, 3000, 6000) == 5);
+    r.Close();
+
+    // Once the records from before the step have aged out the ring is sorted again
+    for (int k = 5; k < 20; k++)
+        append(h, k * 1000, k);
+    CHECK(count(h, 0, 100000) == 16);
+    CHECK(count(h, 10000, 15000) == 5);
+    CHECK(count(h, 3000, 6000) == 2);       // the 4.5 s record and the new 5 s one
+
+    h.Close();
+    unlink(path);
+    return TEST_RESULT();
+}
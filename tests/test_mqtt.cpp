@@ -0,0 +1,179 @@
+// cMqttClient against a stub broker on the loopback: CONNECT and PUBLISH framing, keepalive
+// pings, reconnect when a ping goes unanswered, and keepalive 0 (no pings, no busy loop)
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string>
+#include "../mqtt.h"
+#include "test.h"
+
+static int64_t now_ms(clockid_t clock = CLOCK_MONOTONIC) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool read_full(int fd, unsigned char *p, size_t len, int64_t deadline) {
+    while (len > 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int wait = deadline - now_ms();
+        if (wait <= 0 || poll(&pfd, 1, wait) <= 0)
+            return false;
+        int n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// One MQTT packet: fixed header type byte and the body after the remaining length.
+// False on timeout or EOF.
+static bool read_packet(int fd, int timeout_ms, unsigned char *type, std::string *body) {
+    int64_t deadline = now_ms() + timeout_ms;
+    unsigned char b;
+    size_t len = 0;
+    int shift = 0;
+
+    if (!read_full(fd, type, 1, deadline))
+        return false;
+    do {
+        if (!read_full(fd, &b, 1, deadline) || shift > 21)
+            return false;
+        len |= (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    body->resize(len);
+    return len == 0 || read_full(fd, (unsigned char*)&(*body)[0], len, deadline);
+}
+
+static int accept_client(int lfd, int timeout_ms) {
+    struct pollfd pfd = { lfd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return -1;
+    return accept(lfd, NULL, NULL);
+}
+
+// Reads the CONNECT, checks it and accepts the session
+static bool handshake(int fd, int keepalive) {
+    unsigned char type;
+    std::string body;
+
+    if (!read_packet(fd, 3000, &type, &body))
+        return false;
+    CHECK(type == 0x10);
+    static const char head[] = "\x00\x04MQTT\x04\x02";     // protocol name, level 4, clean session
+    CHECK(body.size() > 10 && !memcmp(body.data(), head, 8));
+    CHECK(body.size() > 10 && (unsigned char)body[8] == (keepalive >> 8) && (unsigned char)body[9] == (keepalive & 0xff));
+    CHECK(body.size() > 12 && body.substr(12) == "inverter_poller" && body[10] == 0 && body[11] == 15);
+
+    const unsigned char connack[4] = { 0x20, 0x02, 0x00, 0x00 };
+    return write(fd, connack, 4) == 4;
+}
+
+static void check_publish(int fd, int unit) {
+    unsigned char type;
+    std::string body;
+
+    CHECK(read_packet(fd, 2000, &type, &body));
+    CHECK(type == 0x30);                                // QoS 0, no retain
+    std::string topic = "test/" + std::to_string(unit);
+    CHECK(body.size() > 2 + topic.size());
+    if (body.size() <= 2 + topic.size())
+        return;
+    CHECK((unsigned char)body[0] == 0 && (unsigned char)body[1] == topic.size());
+    CHECK(body.compare(2, topic.size(), topic) == 0);
+    std::string payload = body.substr(2 + topic.size());
+    CHECK(payload.size() > 127);                        // took a two byte remaining length
+    CHECK(payload[0] == '{' && payload[payload.size() - 1] == '}');
+    CHECK(payload.find("\"Unit\":" + std::to_string(unit)) != std::string::npos);
+}
+
+int main() {
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 4) ||
+        getsockname(lfd, (struct sockaddr*)&addr, &alen)) {
+        perror("stub broker");
+        return 1;
+    }
+
+    MqttConfig cfg;
+    cfg.host = "127.0.0.1";
+    cfg.port = ntohs(addr.sin_port);
+    cfg.topic = "test";
+
+    Sample s;
+    memset(&s, 0, sizeof(s));
+    s.unit = 2;
+
+    // Keepalive 1 s: a ping once the link has been idle for half of it
+    {
+        cfg.keepalive = 1;
+        cMqttClient client(cfg);
+        client.Start();
+
+        int fd = accept_client(lfd, 3000);
+        CHECK(fd != -1);
+        CHECK(fd != -1 && handshake(fd, 1));
+        client.PublishSample(s);
+        check_publish(fd, 2);
+
+        unsigned char type;
+        std::string body;
+        int64_t t0 = now_ms();
+        CHECK(read_packet(fd, 2000, &type, &body) && type == 0xc0 && body.empty());
+        CHECK(now_ms() - t0 >= 300);
+        const unsigned char pingresp[2] = { 0xd0, 0x00 };
+        CHECK(write(fd, pingresp, 2) == 2);
+
+        // The next ping goes unanswered: the client gives up on us and comes back
+        CHECK(read_packet(fd, 2000, &type, &body) && type == 0xc0);
+        t0 = now_ms();
+        while (read_packet(fd, 3000, &type, &body))
+            CHECK(type == 0xe0);                        // at most a DISCONNECT before EOF
+        CHECK(now_ms() - t0 < 2500);
+        close(fd);
+
+        fd = accept_client(lfd, 3000);
+        CHECK(fd != -1);
+        CHECK(fd != -1 && handshake(fd, 1));
+        client.Stop();
+        close(fd);
+    }
+
+    // Keepalive 0: no pings at all, and the idle client does not spin
+    {
+        cfg.keepalive = 0;
+        cMqttClient client(cfg);
+        client.Start();
+
+        int fd = accept_client(lfd, 3000);
+        CHECK(fd != -1);
+        CHECK(fd != -1 && handshake(fd, 0));
+
+        int64_t cpu = now_ms(CLOCK_PROCESS_CPUTIME_ID);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        CHECK(poll(&pfd, 1, 1500) == 0);
+        CHECK(now_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu < 200);
+
+        // It still publishes
+        client.PublishSample(s);
+        check_publish(fd, 2);
+        client.Stop();
+        close(fd);
+    }
+
+    close(lfd);
+    return TEST_RESULT();
+}
@@ -0,0 +1,42 @@
+// Protocol registry: command lookup and the text that goes on the wire
+#include <string.h>
+#include <time.h>
+#include "../protocol.h"
+#include "test.h"
+
+static const char *sent(const char *cmd) {
+    static char out[64];
+    ProtoCommandText(ProtoFind(cmd), cmd, out, sizeof(out));
+    return out;
+}
+
+int main() {
+    char today[16];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    // Plain commands go out as they are
+    CHECK(!strcmp(sent("QPIGS"), "QPIGS"));
+    CHECK(!strcmp(sent("QPGS1"), "QPGS1"));
+    CHECK(!strcmp(sent("POP02"), "POP02"));     // not in the registry
+
+    // Dated commands by their bare name get today's date
+    strftime(today, sizeof(today), "QED%Y%m%d", &tm);
+    CHECK(!strcmp(sent("QED"), today));
+    strftime(today, sizeof(today), "QEY%Y", &tm);
+    CHECK(!strcmp(sent("QEY"), today));
+
+    // ...but one that already carries its date is sent byte for byte (-r, control socket)
+    CHECK(ProtoFind("QED20260101") == ProtoFind("QED"));
+    CHECK(!strcmp(sent("QED20260101"), "QED20260101"));
+    CHECK(!strcmp(sent("QEY2025"), "QEY2025"));
+    CHECK(!strcmp(sent("QEM202501"), "QEM202501"));
+
+    // Too small a buffer truncates, never overruns
+    char small[4];
+    ProtoCommandText(ProtoFind("QED"), "QED", small, sizeof(small));
+    CHECK(!strcmp(small, "QED"));
+
+    return TEST_RESULT();
+}
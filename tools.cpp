@@ -1,60 +1,22 @@
-#include <mutex>
 #include <stdio.h>
-#include <stdint.h>
-#include <stdarg.h>
-#include <sys/time.h>
-#include <string>
-#include <string.h>
-#include <time.h>
-#include <unistd.h>
-#include "main.h"
 #include "tools.h"
 
-std::mutex log_mutex;
-
-void lprintf(const char *format, ...) {
-  // Only print if debug flag is set, else do nothing
-  if (debugFlag) {
-        va_list ap;
-        char fmt[2048];
-
-        //actual time
-        time_t rawtime;
-        struct tm *timeinfo;
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
-        char buf[256];
-        strcpy(buf, asctime(timeinfo));
-        buf[strlen(buf)-1] = 0;
-
-        //connect with args
-        snprintf(fmt, sizeof(fmt), "%s %s\n", buf, format);
-
-        //put on screen:
-        va_start(ap, format);
-        vprintf(fmt, ap);
-        va_end(ap);
-
-        //to the logfile:
-        static FILE *log;
-        log_mutex.lock();
-        log = fopen(LOG_FILE, "a");
-        va_start(ap, format);
-        vfprintf(log, fmt, ap);
-        va_end(ap);
-        fclose(log);
-        log_mutex.unlock();
-    }
-}
-
 int print_help() {
-    printf("\nUSAGE:  ./inverter_poller <args> [-r <command>], [-h | --help], [-1 | --run-once]\n\n");
+    printf("\nUSAGE:  ./inverter_poller <args> [-r <command> [-u <unit>] [-p <priority>]], [-h | --help], [-1 | --run-once], [-q <queries>]\n\n");
 
     printf("SUPPORTED ARGUMENTS:\n");
     printf("          -r <raw-command>      TX 'raw' command to the inverter\n");
+    printf("          -u <unit>             Inverter to send the raw command to (default 0, the first 'device=')\n");
+    printf("          -p <priority>         Priority of the raw command in a running poller's queue (default 10)\n");
     printf("          -h | --help           This Help Message\n");
     printf("          -1 | --run-once       Runs one iteration on the inverter, and then exits\n");
-    printf("          -d                    Additional debugging\n\n");
+    printf("          -q <cmd>[,<cmd>...]   Run once with just these queries (e.g. -q QPIGS,QMOD)\n");
+    printf("          -o <format>           Output format: json, ndjson, csv or binary (default from inverter.conf)\n");
+    printf("          -H <field>            Print the stored history of a field (see history_file=), then exit\n");
+    printf("          -s <seconds>          History: how far back (default 86400)\n");
+    printf("          -b <seconds>          History: min/max/avg per bucket of this size (default 3600, 0 = every point)\n");
+    printf("          -R <capture-file>     Replay recorded traffic (see capture_file=) through parser and output, then exit\n");
+    printf("          -d                    Additional debugging (same as log_level=debug)\n\n");
 
     printf("RAW COMMAND EXAMPLES (see protocol manual for complete list):\n");
     printf("Set output source priority  POP00     (Utility first)\n");
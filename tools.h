@@ -1,9 +1,8 @@
 #ifndef ___TOOLS_H
 #define ___TOOLS_H
 
-#define LOG_FILE "/dev/null"
+#include "log.h"
 
-void lprintf(const char *format, ...);
 int print_help();
 
 #endif // ___TOOLS_H
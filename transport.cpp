@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "transport.h"
+#include "serial.h"
+#include "hidraw.h"
+#include "tools.h"
+
+using namespace std::chrono;
+
+cTransport::cTransport(std::string devicename) {
+    device = devicename;
+    fd = -1;
+    backoff = 0;
+    next_attempt = steady_clock::now();
+}
+
+cTransport::~cTransport() {
+    if (fd != -1)
+        close(fd);
+}
+
+cTransport *cTransport::Create(const std::string &devicename) {
+    char path[PATH_MAX];
+    const char *name = realpath(devicename.c_str(), path) ? path : devicename.c_str();
+    const char *base = strrchr(name, '/');
+
+    if (!strncmp(base ? base + 1 : name, "hidraw", 6))
+        return new cHidrawPort(devicename);
+    return new cSerialPort(devicename);
+}
+
+bool cTransport::Connect() {
+    if (fd != -1)
+        return true;
+
+    // Still backing off after the last failure - don't hammer a missing device
+    if (steady_clock::now() < next_attempt)
+        return false;
+
+    fd = open(device.data(), O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1) {
+        lwarn("INVERTER: Unable to open device file (errno=%d %s)", errno, strerror(errno));
+        failures++;
+        Disconnect();
+        return false;
+    }
+    // One owner per device: a second poller (or a -r run) must not interleave bytes with us.
+    // The lock lives as long as the port stays open.
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        lerror("INVERTER: %s is in use by another process", device.data());
+        failures++;
+        Disconnect();
+        return false;
+    }
+    if (!configure()) {
+        lerror("INVERTER: Unable to configure %s (errno=%d %s)", device.data(), errno, strerror(errno));
+        failures++;
+        Disconnect();
+        return false;
+    }
+
+    linfo("INVERTER: %s opened", device.data());
+    backoff = 0;
+    opens++;
+    return true;
+}
+
+void cTransport::Disconnect() {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    // Double the delay on every consecutive failure, up to BACKOFF_MAX
+    backoff = backoff ? backoff * 2 : BACKOFF_MIN;
+    if (backoff > BACKOFF_MAX)
+        backoff = BACKOFF_MAX;
+    next_attempt = steady_clock::now() + milliseconds(backoff);
+    lprintf("INVERTER: %s closed, next reconnect attempt in %d ms", device.data(), backoff);
+}
+
+int cTransport::MsUntilReconnect() {
+    if (fd != -1)
+        return 0;
+    int ms = duration_cast<milliseconds>(next_attempt - steady_clock::now()).count();
+    return ms > 0 ? ms : 0;
+}
+
+int cTransport::wait(short events, int timeout_ms) {
+    struct pollfd pfd = { fd, events, 0 };
+
+    int r = ::poll(&pfd, 1, timeout_ms);
+    if (r == 0 || (r < 0 && errno == EINTR))
+        return 0;
+    if (r < 0 || ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) && !(pfd.revents & events))) {
+        lprintf("INVERTER: %s is gone (revents=0x%x errno=%d)", device.data(), pfd.revents, errno);
+        Disconnect();
+        return -1;
+    }
+    return 1;
+}
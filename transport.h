@@ -0,0 +1,57 @@
+#ifndef ___TRANSPORT_H
+#define ___TRANSPORT_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Long-lived connection to an inverter, whatever it is wired through.
+// The device is opened, locked and set up once, and kept open across queries.  When it
+// vanishes (USB unplugged, adapter reset...) it is closed and reconnect attempts are spaced
+// out with an exponential backoff instead of a fixed sleep.
+// The backends only differ in setting the device up and in how bytes go in and out:
+//   cSerialPort   termios tty (RS232, USB<>serial adapters), a byte stream
+//   cHidrawPort   the inverter's own USB port, 8 byte HID reports
+
+class cTransport {
+    int backoff;                                        // current reconnect delay (ms)
+    std::chrono::steady_clock::time_point next_attempt; // earliest time for the next open()
+    std::atomic<unsigned long> opens{0};                // for the metrics endpoint
+    std::atomic<unsigned long> failures{0};
+
+    protected:
+        std::string device;
+        int fd;
+
+        virtual bool configure() = 0;   // right after open() and locking
+
+        // Waits for 'events' on fd: 1 ready, 0 timeout, -1 the device failed (and was closed)
+        int wait(short events, int timeout_ms);
+
+    public:
+        static const int BACKOFF_MIN = 250;
+        static const int BACKOFF_MAX = 30000;
+
+        cTransport(std::string devicename);
+        virtual ~cTransport();
+
+        // hidraw devices (also through a symlink) get cHidrawPort, anything else cSerialPort
+        static cTransport *Create(const std::string &devicename);
+
+        bool Connect();
+        void Disconnect();
+        bool IsOpen() { return fd != -1; }
+        int Fd() { return fd; }
+        int MsUntilReconnect();
+        unsigned long Opens() const { return opens; }
+        unsigned long Failures() const { return failures; }
+
+        virtual bool Write(const void *data, int len) = 0;
+        // Blocks until data arrives or timeout_ms elapses, then returns what is available:
+        // the number of bytes read, 0 on timeout, or -1 if the device failed (and was closed)
+        virtual int Read(void *data, int len, int timeout_ms) = 0;
+        virtual void FlushInput() = 0;      // drop everything received but not read yet
+        virtual void FlushOutput() {}       // drop everything written but not sent yet
+};
+
+#endif // ___TRANSPORT_H